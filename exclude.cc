@@ -35,8 +35,14 @@ using std::pair;
 using std::string;
 
 FilePattern::FilePattern(const string& pattern, const string& basedir)
-    : refcount(1), orig_pattern(pattern), valid(false)
+    : refcount(1), orig_pattern(pattern), match_type(MATCH_REGEX),
+      anchored(false), dir_only(false), valid(false)
 {
+    if (classify(pattern, basedir)) {
+        valid = true;
+        return;
+    }
+
     string pattern_as_regex = pattern_to_regex(pattern, basedir);
     int status = regcomp(&regex, pattern_as_regex.c_str(),
                          REG_EXTENDED|REG_NOSUB);
@@ -54,16 +60,90 @@ FilePattern::FilePattern(const string& pattern, const string& basedir)
 
 FilePattern::~FilePattern()
 {
-    if (valid)
+    if (valid && match_type == MATCH_REGEX)
         regfree(&regex);
 }
 
+/* Decide whether a pattern can be matched with plain string comparisons.  The
+ * fast paths must agree exactly with the regular expressions produced by
+ * pattern_to_regex; anything unusual falls back to the regex engine. */
+bool FilePattern::classify(const string& pattern, const string& basedir)
+{
+    if (pattern.empty())
+        return false;
+
+    string core = pattern;
+    dir_only = (core[core.size() - 1] == '/');
+
+    anchored = (core[0] == '/');
+    if (anchored)
+        core = core.substr(1);
+
+    bool suffix = false;
+    if (!anchored && !core.empty() && core[0] == '*') {
+        suffix = true;
+        core = core.substr(1);
+    }
+
+    /* Any remaining metacharacters require the regular expression. */
+    if (core.find_first_of("*?[\\") != string::npos)
+        return false;
+
+    if (!basedir.empty() && basedir != ".")
+        prefix = basedir + "/";
+    literal = core;
+    match_type = suffix ? MATCH_SUFFIX : MATCH_LITERAL;
+    return true;
+}
+
+/* Does one string end with another? */
+static inline bool ends_with(const string& s, const string& suffix)
+{
+    return s.size() >= suffix.size()
+        && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 bool FilePattern::matches(const std::string& path) const
 {
     if (!valid)
         return false;
-    else
+
+    if (match_type == MATCH_REGEX)
         return regexec(&regex, path.c_str(), 0, NULL, 0) == 0;
+
+    /* A pattern without a trailing slash matches whether or not the path has
+     * one; strip it so only one comparison is needed.  Directory-only
+     * patterns keep their trailing slash in the literal. */
+    string stripped;
+    const string *p = &path;
+    if (!dir_only && !path.empty() && path[path.size() - 1] == '/') {
+        stripped = path.substr(0, path.size() - 1);
+        p = &stripped;
+    }
+
+    if (!prefix.empty() && p->compare(0, prefix.size(), prefix) != 0)
+        return false;
+
+    if (match_type == MATCH_SUFFIX) {
+        /* "*" never matches a slash, but since it immediately precedes the
+         * literal, a simple suffix comparison is exact: the characters the
+         * star consumes run from the preceding slash (or the start of the
+         * path) to the start of the literal.  The length check keeps the
+         * suffix from overlapping the base directory prefix. */
+        return p->size() >= prefix.size() + literal.size()
+            && ends_with(*p, literal);
+    }
+
+    /* MATCH_LITERAL: an anchored pattern must match the whole path (after
+     * any base directory); otherwise any whole number of leading path
+     * components may be skipped.  As above, the matched components must lie
+     * entirely beyond the base directory prefix. */
+    if (*p == prefix + literal)
+        return true;
+    if (anchored)
+        return false;
+    return p->size() >= prefix.size() + 1 + literal.size()
+        && ends_with(*p, "/" + literal);
 }
 
 string FilePattern::pattern_to_regex(const string& pattern,
@@ -388,6 +468,13 @@ int main(int argc, char *argv[])
     test_pattern(".cache", "home", "home/user/.cache", true);
     test_pattern("user/.cache", "home", "home/user/.cache", true);
     test_pattern("user/.cache", "home/user", "home/user/.cache", false);
+    test_pattern("*.o", "", "a/b/c.o/", true);
+    test_pattern("*.git/", "", "repo/project.git", false);
+    test_pattern("/var/tmp", "", "var/tmp", true);
+    test_pattern("/var/tmp", "", "usr/var/tmp", false);
+    test_pattern("var/tmp", "", "usr/var/tmp", true);
+    test_pattern("*.o", "home", "home/a.o", true);
+    test_pattern("*.o", "home", "homer/a.o", false);
 
     PathFilterList pfl;
     pfl.add_pattern(PathFilterList::DIRMERGE, ".cumulus-filter", "");
@@ -71,6 +71,21 @@ public:
     bool matches(const std::string& path) const;
 
 private:
+    /* Most patterns in practice contain no metacharacters at all ("/var/tmp",
+     * ".cache") or are a simple "*"-plus-suffix ("*.o").  Those are matched
+     * with direct string comparisons; only patterns actually needing
+     * wildcards fall back to a compiled regular expression. */
+    enum MatchType {
+        MATCH_REGEX,            // General pattern: use the compiled regex
+        MATCH_LITERAL,          // Pattern is a literal path (no wildcards)
+        MATCH_SUFFIX,           // Pattern is "*" followed by a literal
+    };
+
+    /* Examine the pattern and select a matching strategy; fills in
+     * match_type, literal, prefix, anchored, and dir_only.  Returns true if a
+     * fast path applies (and the regular expression is not needed). */
+    bool classify(const std::string& pattern, const std::string& basedir);
+
     /* Compiles a Cumulus pattern to a regular expression.  This is used for
      * the underlying matching implementation. */
     static std::string pattern_to_regex(const std::string& pattern,
@@ -83,6 +98,12 @@ private:
     int refcount;  // Reference count for object lifetime management.
     std::string orig_pattern;  // Original pattern, returned by pattern()
 
+    MatchType match_type;       // Matching strategy for this pattern
+    std::string literal;        // Literal text for the fast-path strategies
+    std::string prefix;         // Required path prefix ("basedir/"), if any
+    bool anchored;              // Pattern had a leading slash
+    bool dir_only;              // Pattern only matches directories
+
     bool valid;  // True if regex is valid and initialized
     regex_t regex;  // The pattern, converted to a compiled regular expression
 };
@@ -105,11 +105,16 @@ string Hash::digest_str()
     return name() + "=" + hexbuf;
 }
 
+void hash_simd_register();
 void sha1_register();
 void sha256_register();
 
 void hash_init()
 {
+    /* Register hardware-accelerated implementations first: for a given
+     * algorithm name the first registration wins, and the reference
+     * implementations below then serve as the fallback. */
+    hash_simd_register();
     sha1_register();
     sha256_register();
     default_algorithm = "sha224";
@@ -27,18 +27,27 @@
  * changed later. */
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/file.h>
 #include <sqlite3.h>
 
 #include <algorithm>
 #include <map>
 #include <string>
 
+#include "hash.h"
 #include "localdb.h"
+#include "metrics.h"
 #include "store.h"
 #include "util.h"
 
+using std::list;
 using std::map;
 using std::max;
 using std::min;
@@ -48,6 +57,15 @@ using std::string;
 static const int SCHEMA_MAJOR = 0;
 static const int SCHEMA_MINOR = 11;
 
+/* Tuning for the background writer thread.  A group commit is issued once
+ * this many writes have accumulated, or when the queue drains and the
+ * previous commit is at least COMMIT_INTERVAL seconds old; this bounds how
+ * much bookkeeping an interrupted backup can lose.  Enqueueing blocks once
+ * the queue reaches MAX_WRITE_QUEUE entries, to bound memory use. */
+static const int COMMIT_THRESHOLD = 4096;
+static const time_t COMMIT_INTERVAL = 60;
+static const size_t MAX_WRITE_QUEUE = 65536;
+
 /* Helper function to prepare a statement for execution in the current
  * database. */
 sqlite3_stmt *LocalDb::Prepare(const char *sql)
@@ -83,15 +101,54 @@ void LocalDb::Open(const char *path, const char *snapshot_name,
         fatal("Error opening local database");
     }
 
-    rc = sqlite3_exec(db, "begin", NULL, NULL, NULL);
+    sqlite3_extended_result_codes(db, 1);
+
+    /* Mark the database as in use with an advisory lock, held shared for the
+     * duration of the run.  If the exclusive lock can be taken here then no
+     * other backup shares the database, and the interrupted-backup cleanup
+     * below is safe to run. */
+    bool exclusive = false;
+    string lock_path = string(path) + ".lock";
+    lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (lock_fd >= 0) {
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+            exclusive = true;
+        } else if (flock(lock_fd, LOCK_SH) < 0) {
+            fprintf(stderr, "Warning: unable to lock %s: %m\n",
+                    lock_path.c_str());
+        }
+    } else {
+        fprintf(stderr, "Warning: unable to create %s: %m\n",
+                lock_path.c_str());
+    }
+
+    /* Allow multiple backup processes (one per --scheme) to share the
+     * database.  WAL journaling lets readers proceed while another process
+     * commits, and the busy timeout makes writers queue behind each other
+     * instead of failing; each process only holds the write lock for the
+     * duration of one write batch.  synchronous=normal skips the fsync on
+     * every batch commit--in WAL mode this can lose the latest batches on a
+     * power failure but cannot corrupt the database, which is fine for data
+     * that the next backup run simply regenerates.  The journal-mode pragma
+     * fails harmlessly (leaving rollback journaling) on filesystems that
+     * cannot support WAL. */
+    /* Generously longer than COMMIT_INTERVAL, the longest another process
+     * will sit on the write lock. */
+    sqlite3_busy_timeout(db, 300000);
+    sqlite3_exec(db, "pragma journal_mode = wal", NULL, NULL, NULL);
+    sqlite3_exec(db, "pragma synchronous = normal", NULL, NULL, NULL);
+
+    /* "begin immediate" (here and for every write batch) takes the write
+     * lock up front, where the busy handler waits for it; a deferred
+     * transaction that later upgrades from reading to writing fails
+     * immediately instead if another process has committed in between. */
+    rc = sqlite3_exec(db, "begin immediate", NULL, NULL, NULL);
     if (rc) {
         fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
         sqlite3_close(db);
         fatal("Error starting transaction");
     }
 
-    sqlite3_extended_result_codes(db, 1);
-
     /* Check that the local database format is the correct version; if not,
      * report an error. */
     sqlite3_stmt *stmt = Prepare("select major, minor from schema_version");
@@ -116,27 +173,33 @@ void LocalDb::Open(const char *path, const char *snapshot_name,
         snapshot_scheme = "";
 
     /* Insert this snapshot into the database, and determine the integer key
-     * which will be used to identify it. */
-    stmt = Prepare("insert into snapshots(name, scheme, timestamp) "
-                   "values (?, ?, julianday('now'))");
-    sqlite3_bind_text(stmt, 1, snapshot_name, strlen(snapshot_name),
-                      SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, snapshot_scheme, strlen(snapshot_scheme),
-                      SQLITE_TRANSIENT);
+     * which will be used to identify it.  Maintenance tools (such as
+     * cumulus-repack) which manipulate the database without creating a
+     * snapshot pass a NULL snapshot_name. */
+    if (snapshot_name != NULL) {
+        stmt = Prepare("insert into snapshots(name, scheme, timestamp) "
+                       "values (?, ?, julianday('now'))");
+        sqlite3_bind_text(stmt, 1, snapshot_name, strlen(snapshot_name),
+                          SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, snapshot_scheme, strlen(snapshot_scheme),
+                          SQLITE_TRANSIENT);
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        ReportError(rc);
-        sqlite3_close(db);
-        fatal("Database execution error!");
-    }
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            ReportError(rc);
+            sqlite3_close(db);
+            fatal("Database execution error!");
+        }
 
-    snapshotid = sqlite3_last_insert_rowid(db);
-    sqlite3_finalize(stmt);
-    if (snapshotid == 0) {
-        ReportError(rc);
-        sqlite3_close(db);
-        fatal("Find snapshot id");
+        snapshotid = sqlite3_last_insert_rowid(db);
+        sqlite3_finalize(stmt);
+        if (snapshotid == 0) {
+            ReportError(rc);
+            sqlite3_close(db);
+            fatal("Find snapshot id");
+        }
+    } else {
+        snapshotid = 0;
     }
 
     /* Create a temporary table which will be used to keep track of the objects
@@ -162,13 +225,432 @@ void LocalDb::Open(const char *path, const char *snapshot_name,
         sqlite3_close(db);
         fatal("Database initialization");
     }
+
+    EnsureChunkIndex();
+
+    /* Discard bookkeeping left behind by segments which an interrupted run
+     * never finished writing: their block_index rows may have been committed
+     * (the writer thread commits periodically) even though the segment file
+     * itself never made it to the store.  Such segments are recognizable by
+     * having no metadata recorded--SetSegmentMetadata runs when a segment is
+     * finalized--and no snapshot references, which also protects entries
+     * imported from older databases that predate segment metadata.
+     *
+     * The cleanup only runs if no other backup currently shares the
+     * database: a concurrently running backup's open segments look exactly
+     * like interrupted ones until they are finalized, so purging them here
+     * would corrupt that run's bookkeeping. */
+    static const char *cleanup_sql[] = {
+        "create temporary table dead_segments as "
+        "    select segmentid from segments "
+        "    where checksum is null and segmentid not in "
+        "        (select segmentid from segment_utilization)",
+        "delete from subblock_signatures where blockid in "
+        "    (select blockid from block_index "
+        "     where segmentid in (select segmentid from dead_segments))",
+        "delete from chunk_index where blockid in "
+        "    (select blockid from block_index "
+        "     where segmentid in (select segmentid from dead_segments))",
+        "delete from block_index "
+        "    where segmentid in (select segmentid from dead_segments)",
+        "delete from segments "
+        "    where segmentid in (select segmentid from dead_segments)",
+        "drop table dead_segments",
+        NULL
+    };
+    if (exclusive) {
+        for (int i = 0; cleanup_sql[i] != NULL; i++) {
+            rc = sqlite3_exec(db, cleanup_sql[i], NULL, NULL, NULL);
+            if (rc != SQLITE_OK) {
+                ReportError(rc);
+                fatal("Unable to clean up interrupted-backup segments");
+            }
+        }
+
+        /* Downgrade to a shared lock so that backups of other schemes can
+         * start while this one runs. */
+        if (flock(lock_fd, LOCK_SH) < 0)
+            fprintf(stderr, "Warning: unable to downgrade lock on %s: %m\n",
+                    lock_path.c_str());
+    }
+
+    LoadBlockIndex();
+
+    /* Commit the setup work immediately so the write lock is released;
+     * later writes run in short transactions scoped to one batch each,
+     * opened lazily by the writer thread.  Holding a single transaction
+     * across the whole run (as older versions did) would lock out any
+     * concurrent backup of another scheme. */
+    rc = sqlite3_exec(db, "commit", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        ReportError(rc);
+        fatal("Unable to commit database setup");
+    }
+
+    /* Start the background writer thread which applies StoreObject/UseObject/
+     * StoreChunkSignatures operations asynchronously. */
+    pthread_mutex_init(&db_lock, NULL);
+    pthread_mutex_init(&queue_lock, NULL);
+    pthread_cond_init(&queue_cond, NULL);
+    writer_terminate = false;
+    writes_uncommitted = 0;
+    txn_open = false;
+    if (pthread_create(&writer, NULL, LocalDb::StartWriterThread,
+                       (void *)this) != 0)
+        fatal("Cannot create database writer thread");
+}
+
+void LocalDb::Enqueue(const PendingWrite &op)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (write_queue.size() >= MAX_WRITE_QUEUE)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    write_queue.push_back(op);
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* Wait until the writer thread has executed all queued operations.  Called
+ * before reads which must observe earlier writes (and before closing). */
+void LocalDb::WaitForWrites()
+{
+    pthread_mutex_lock(&queue_lock);
+    while (!write_queue.empty())
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void *LocalDb::StartWriterThread(void *arg)
+{
+    LocalDb *db = static_cast<LocalDb *>(arg);
+    db->WriterThread();
+    return NULL;
+}
+
+/* Background thread which drains the write queue.  Operations execute in
+ * enqueue order; a transaction is opened lazily around the first write of a
+ * batch and committed once the batch is large or old enough, so the database
+ * write lock is never held while the queue is idle and other backup
+ * processes can interleave their own batches. */
+void LocalDb::WriterThread()
+{
+    time_t last_commit = time(NULL);
+
+    pthread_mutex_lock(&queue_lock);
+    while (true) {
+        if (write_queue.empty()) {
+            bool commit_now = writes_uncommitted >= COMMIT_THRESHOLD
+                || (writes_uncommitted > 0
+                    && time(NULL) >= last_commit + COMMIT_INTERVAL);
+            if (!commit_now && writer_terminate)
+                break;
+            if (!commit_now) {
+                /* Wake up periodically so time-based commits still happen
+                 * when the backup thread is busy elsewhere. */
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 5;
+                pthread_cond_timedwait(&queue_cond, &queue_lock, &deadline);
+                continue;
+            }
+
+            pthread_mutex_unlock(&queue_lock);
+            pthread_mutex_lock(&db_lock);
+            if (txn_open) {
+                if (sqlite3_exec(db, "commit", NULL, NULL, NULL)
+                        != SQLITE_OK) {
+                    fprintf(stderr,
+                            "DATABASE ERROR: Unable to commit write batch!\n");
+                }
+                txn_open = false;
+            }
+            pthread_mutex_unlock(&db_lock);
+            last_commit = time(NULL);
+            pthread_mutex_lock(&queue_lock);
+            writes_uncommitted = 0;
+            continue;
+        }
+
+        PendingWrite op = write_queue.front();
+        pthread_mutex_unlock(&queue_lock);
+
+        MetricsTimer db_timer(METRICS_DB);
+        pthread_mutex_lock(&db_lock);
+        if (!txn_open) {
+            if (sqlite3_exec(db, "begin immediate", NULL, NULL, NULL)
+                    != SQLITE_OK)
+                fprintf(stderr,
+                        "DATABASE ERROR: Unable to start write batch!\n");
+            else
+                txn_open = true;
+        }
+        switch (op.type) {
+        case PendingWrite::STORE_OBJECT:
+            ExecStoreObject(op.ref, op.age);
+            break;
+        case PendingWrite::USE_OBJECT:
+            ExecUseObject(op.ref);
+            break;
+        case PendingWrite::STORE_SIGNATURES:
+            ExecStoreChunkSignatures(op.ref, op.data, op.algorithm);
+            break;
+        }
+        pthread_mutex_unlock(&db_lock);
+
+        pthread_mutex_lock(&queue_lock);
+        write_queue.pop_front();
+        writes_uncommitted++;
+        pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+string LocalDb::BlockLookupKey(const string &checksum, int64_t size)
+{
+    char buf[24];
+    sprintf(buf, "/%lld", (long long)size);
+    return checksum + buf;
+}
+
+string LocalDb::ChunkLookupKey(const string &algorithm, const string &hash)
+{
+    return algorithm + "=" + hash;
+}
+
+/* Determine the digest size used by a chunk signature algorithm, which is
+ * named "<chunker>/<hash>".  Returns 0 if the hash algorithm is unknown. */
+static size_t algorithm_hash_size(const string &algorithm)
+{
+    size_t slash = algorithm.rfind('/');
+    if (slash == string::npos)
+        return 0;
+
+    Hash *hasher = Hash::New(algorithm.substr(slash + 1));
+    if (hasher == NULL)
+        return 0;
+    size_t size = hasher->digest_size();
+    delete hasher;
+    return size;
+}
+
+/* Load the (checksum, size) -> object mapping for all unexpired blocks into
+ * an in-memory hash table.  FindObject then runs as a memory probe rather
+ * than one SQL query per block dumped. */
+void LocalDb::LoadBlockIndex()
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    stmt = Prepare("select segments.segment, block_index.object, "
+                   "    block_index.checksum, block_index.size "
+                   "from block_index join segments "
+                   "    on block_index.segmentid = segments.segmentid "
+                   "where block_index.expired is null");
+
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            const char *segment
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            const char *object
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            const char *checksum
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+            int64_t size = sqlite3_column_int64(stmt, 3);
+
+            if (segment == NULL || object == NULL || checksum == NULL)
+                continue;
+
+            ObjectReference ref(segment, object);
+            ref.set_range(0, size, true);
+            block_lookup[BlockLookupKey(checksum, size)] = ref;
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else {
+            ReportError(rc);
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+/* Insert one row into chunk_index for every chunk in a packed signature
+ * block.  Any rows from an earlier version of the block's signatures are
+ * removed first, matching the "insert or replace" semantics of the
+ * subblock_signatures table itself.  The caller must hold db_lock (or be
+ * running single-threaded, as during Open). */
+void LocalDb::InsertChunkIndex(int64_t blockid, const string &data,
+                               const string &algorithm)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    size_t hash_size = algorithm_hash_size(algorithm);
+    if (hash_size == 0)
+        return;
+
+    stmt = Prepare("delete from chunk_index where blockid = ?");
+    sqlite3_bind_int64(stmt, 1, blockid);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
+        ReportError(rc);
+    sqlite3_finalize(stmt);
+
+    stmt = Prepare("insert into chunk_index(hash, blockid, offset, length) "
+                   "values (?, ?, ?, ?)");
+
+    size_t record_size = 2 + hash_size;
+    int64_t offset = 0;
+    for (size_t i = 0; i + record_size <= data.size(); i += record_size) {
+        uint16_t len;
+        memcpy(&len, data.data() + i, 2);
+        len = ntohs(len);
+
+        sqlite3_bind_blob(stmt, 1, data.data() + i + 2, hash_size,
+                          SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, blockid);
+        sqlite3_bind_int64(stmt, 3, offset);
+        sqlite3_bind_int64(stmt, 4, len);
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Could not insert chunk index entry!\n");
+            ReportError(rc);
+        }
+        sqlite3_reset(stmt);
+
+        offset += len;
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+/* Create the chunk index if this database does not have one yet, and populate
+ * it from any existing subblock signatures.  The chunk_index table maps a
+ * chunk hash to the (object, byte range) where a copy of the chunk is stored,
+ * allowing new data to be deduplicated against chunks of all previous
+ * objects, not just earlier versions of the same file.  The table is
+ * maintained alongside subblock_signatures and can always be rebuilt from it,
+ * so its creation does not bump the schema version. */
+void LocalDb::EnsureChunkIndex()
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    rc = sqlite3_exec(db,
+                      "create table if not exists chunk_index ("
+                      "    hash blob not null,"
+                      "    blockid integer not null,"
+                      "    offset integer not null,"
+                      "    length integer not null"
+                      ")", NULL, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db,
+                          "create index if not exists chunk_index_hash "
+                          "on chunk_index(hash)", NULL, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db,
+                          "create index if not exists chunk_index_blockid "
+                          "on chunk_index(blockid)", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        ReportError(rc);
+        fatal("Unable to create chunk index");
+    }
+
+    /* If the table is already populated (or there are no signatures to index)
+     * there is nothing more to do. */
+    stmt = Prepare("select (select count(*) from chunk_index), "
+                   "       (select count(*) from subblock_signatures)");
+    rc = sqlite3_step(stmt);
+    bool backfill = (rc == SQLITE_ROW
+                     && sqlite3_column_int64(stmt, 0) == 0
+                     && sqlite3_column_int64(stmt, 1) > 0);
+    sqlite3_finalize(stmt);
+    if (!backfill)
+        return;
+
+    /* First run with an existing database: index all stored signatures. */
+    struct pending_sigs {
+        int64_t blockid;
+        string algorithm;
+        string data;
+    };
+    list<pending_sigs> sigs;
+
+    stmt = Prepare("select blockid, algorithm, signatures "
+                   "from subblock_signatures");
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *algorithm
+            = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        const char *blob
+            = static_cast<const char *>(sqlite3_column_blob(stmt, 2));
+        int len = sqlite3_column_bytes(stmt, 2);
+        if (algorithm == NULL || blob == NULL)
+            continue;
+
+        pending_sigs p;
+        p.blockid = sqlite3_column_int64(stmt, 0);
+        p.algorithm = algorithm;
+        p.data = string(blob, len);
+        sigs.push_back(p);
+    }
+    if (rc != SQLITE_DONE)
+        ReportError(rc);
+    sqlite3_finalize(stmt);
+
+    for (list<pending_sigs>::const_iterator i = sigs.begin();
+         i != sigs.end(); ++i) {
+        InsertChunkIndex(i->blockid, i->data, i->algorithm);
+    }
+}
+
+/* Commit everything recorded so far, so that an interruption after this
+ * point loses none of it.  The caller must ensure the segments the queued
+ * writes refer to have been stored first. */
+void LocalDb::Checkpoint()
+{
+    WaitForWrites();
+
+    pthread_mutex_lock(&db_lock);
+    if (txn_open) {
+        if (sqlite3_exec(db, "commit", NULL, NULL, NULL) != SQLITE_OK)
+            fprintf(stderr, "DATABASE ERROR: Unable to commit checkpoint!\n");
+        txn_open = false;
+    }
+    pthread_mutex_unlock(&db_lock);
+
+    pthread_mutex_lock(&queue_lock);
+    writes_uncommitted = 0;
+    pthread_mutex_unlock(&queue_lock);
 }
 
 void LocalDb::Close()
 {
     int rc;
 
-    /* Summarize the snapshot_refs table into segment_utilization. */
+    /* Flush all queued writes and shut down the writer thread before
+     * summarizing and committing. */
+    pthread_mutex_lock(&queue_lock);
+    writer_terminate = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    WaitForWrites();
+    if (pthread_join(writer, NULL) != 0)
+        fprintf(stderr, "Warning: Unable to join database writer thread\n");
+    pthread_cond_destroy(&queue_cond);
+    pthread_mutex_destroy(&queue_lock);
+    pthread_mutex_destroy(&db_lock);
+
+    /* Summarize the snapshot_refs table into segment_utilization, together
+     * with any writes the terminating writer thread left uncommitted. */
+    if (!txn_open) {
+        rc = sqlite3_exec(db, "begin immediate", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "DATABASE ERROR: Can't begin final commit!\n");
+            ReportError(rc);
+        }
+    }
     sqlite3_stmt *stmt = Prepare(
         "insert or replace into segment_utilization "
         "select ? as snapshotid, segmentid, sum(size) "
@@ -190,6 +672,9 @@ void LocalDb::Close()
         ReportError(rc);
     }
     sqlite3_close(db);
+
+    if (lock_fd >= 0)
+        close(lock_fd);
 }
 
 int64_t LocalDb::SegmentToId(const string &segment)
@@ -198,7 +683,16 @@ int64_t LocalDb::SegmentToId(const string &segment)
     sqlite3_stmt *stmt;
     int64_t result;
 
-    stmt = Prepare("insert or ignore into segments(segment) values (?)");
+    std::unordered_map<string, int64_t>::const_iterator cached
+        = segment_id_cache.find(segment);
+    if (cached != segment_id_cache.end())
+        return cached->second;
+
+    /* Record a creation timestamp so that the interrupted-backup cleanup in
+     * Open can tell an abandoned segment from one that a concurrently
+     * running backup is still writing. */
+    stmt = Prepare("insert or ignore into segments(segment, timestamp) "
+                   "values (?, julianday('now'))");
     sqlite3_bind_text(stmt, 1, segment.c_str(), segment.size(),
                       SQLITE_TRANSIENT);
     rc = sqlite3_step(stmt);
@@ -222,6 +716,9 @@ int64_t LocalDb::SegmentToId(const string &segment)
 
     sqlite3_finalize(stmt);
 
+    segment_id_cache[segment] = result;
+    segment_name_cache[result] = segment;
+
     return result;
 }
 
@@ -231,6 +728,11 @@ string LocalDb::IdToSegment(int64_t segmentid)
     sqlite3_stmt *stmt;
     string result;
 
+    std::unordered_map<int64_t, string>::const_iterator cached
+        = segment_name_cache.find(segmentid);
+    if (cached != segment_name_cache.end())
+        return cached->second;
+
     stmt = Prepare("select segment from segments where segmentid = ?");
     sqlite3_bind_int64(stmt, 1, segmentid);
 
@@ -245,17 +747,38 @@ string LocalDb::IdToSegment(int64_t segmentid)
 
     sqlite3_finalize(stmt);
 
+    segment_name_cache[segmentid] = result;
+    segment_id_cache[result] = segmentid;
+
     return result;
 }
 
+/* Queue an object to be recorded in the block index.  The in-memory lookup
+ * table is updated immediately so FindObject sees the object at once; the
+ * database write happens on the writer thread. */
 void LocalDb::StoreObject(const ObjectReference& ref, double age)
+{
+    assert(ref.has_checksum());
+    assert(ref.range_is_exact());
+
+    ObjectReference lookup_ref = ref.base();
+    lookup_ref.set_range(0, ref.get_range_length(), true);
+    block_lookup[BlockLookupKey(ref.get_checksum(), ref.get_range_length())]
+        = lookup_ref;
+
+    PendingWrite op;
+    op.type = PendingWrite::STORE_OBJECT;
+    op.ref = ref;
+    op.age = age;
+    Enqueue(op);
+}
+
+void LocalDb::ExecStoreObject(const ObjectReference& ref, double age)
 {
     int rc;
     sqlite3_stmt *stmt;
 
-    assert(ref.has_checksum());
     string checksum = ref.get_checksum();
-    assert(ref.range_is_exact());
     int64_t size = ref.get_range_length();
 
     if (age == 0.0) {
@@ -292,6 +815,15 @@ ObjectReference LocalDb::FindObject(const string &checksum, int64_t size)
     sqlite3_stmt *stmt;
     ObjectReference ref;
 
+    /* Common case: the block is either found in the in-memory index, or is
+     * new data which will not be found by a database query either. */
+    std::unordered_map<string, ObjectReference>::const_iterator i
+        = block_lookup.find(BlockLookupKey(checksum, size));
+    if (i != block_lookup.end())
+        return i->second;
+
+    MetricsTimer db_timer(METRICS_DB);
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("select segmentid, object from block_index "
                    "where checksum = ? and size = ? and expired is null");
     sqlite3_bind_text(stmt, 1, checksum.c_str(), checksum.size(),
@@ -310,6 +842,7 @@ ObjectReference LocalDb::FindObject(const string &checksum, int64_t size)
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 
     return ref;
 }
@@ -321,6 +854,8 @@ bool LocalDb::IsOldObject(const string &checksum, int64_t size, double *age,
     sqlite3_stmt *stmt;
     bool found = false;
 
+    MetricsTimer db_timer(METRICS_DB);
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("select segmentid, object, julianday(timestamp), expired "
                    "from block_index where checksum = ? and size = ?");
     sqlite3_bind_text(stmt, 1, checksum.c_str(), checksum.size(),
@@ -340,6 +875,7 @@ bool LocalDb::IsOldObject(const string &checksum, int64_t size, double *age,
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 
     return found;
 }
@@ -356,6 +892,8 @@ bool LocalDb::IsAvailable(const ObjectReference &ref)
     if (!ref.is_normal())
         return true;
 
+    MetricsTimer db_timer(METRICS_DB);
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("select count(*) from block_index "
                    "where segmentid = ? and object = ? and expired is null");
     sqlite3_bind_int64(stmt, 1, SegmentToId(ref.get_segment()));
@@ -374,6 +912,7 @@ bool LocalDb::IsAvailable(const ObjectReference &ref)
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 
     return found;
 }
@@ -384,6 +923,10 @@ set<string> LocalDb::GetUsedSegments()
     sqlite3_stmt *stmt;
     set<string> result;
 
+    /* The result must reflect all queued UseObject calls. */
+    WaitForWrites();
+
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("select segment from segments "
                    "where segmentid in (select segmentid from snapshot_refs)");
 
@@ -401,18 +944,278 @@ set<string> LocalDb::GetUsedSegments()
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 
     return result;
 }
 
-void LocalDb::UseObject(const ObjectReference& ref)
+/* List the snapshots which the database still tracks (and which must
+ * therefore remain restorable). */
+list<LocalDb::SnapshotInfo> LocalDb::GetSnapshots()
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    list<SnapshotInfo> result;
+
+    pthread_mutex_lock(&db_lock);
+    stmt = Prepare("select scheme, name from snapshots order by snapshotid");
+
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            const char *scheme
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            const char *name
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            if (name == NULL)
+                continue;
+
+            SnapshotInfo info;
+            info.scheme = (scheme != NULL) ? scheme : "";
+            info.name = name;
+            result.push_back(info);
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else {
+            ReportError(rc);
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
+
+    return result;
+}
+
+/* Return statistics for every segment holding object data, for use by the
+ * segment repacker.  bytes_referenced is the largest live-byte estimate
+ * recorded for the segment by any tracked snapshot; segments never referenced
+ * report zero. */
+list<LocalDb::SegmentStats> LocalDb::GetSegmentStatistics()
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    list<SegmentStats> result;
+
+    WaitForWrites();
+
+    pthread_mutex_lock(&db_lock);
+    stmt = Prepare(
+        "select segments.segment, segments.type, "
+        "    segments.data_size, segments.disk_size, "
+        "    coalesce(u.bytes_referenced, 0), "
+        "    coalesce(julianday('now') - julianday(segments.timestamp), 0) "
+        "from segments left join "
+        "    (select segmentid, max(bytes_referenced) as bytes_referenced "
+        "     from segment_utilization group by segmentid) as u "
+        "    on segments.segmentid = u.segmentid"
+    );
+
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            const char *segment
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            const char *type
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            if (segment == NULL)
+                continue;
+
+            SegmentStats stats;
+            stats.name = segment;
+            stats.type = (type != NULL) ? type : "";
+            stats.data_size = sqlite3_column_int64(stmt, 2);
+            stats.disk_size = sqlite3_column_int64(stmt, 3);
+            stats.bytes_referenced = sqlite3_column_int64(stmt, 4);
+            stats.age_days = sqlite3_column_double(stmt, 5);
+            result.push_back(stats);
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else {
+            ReportError(rc);
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
+
+    return result;
+}
+
+/* Return all unexpired objects stored in the given segment. */
+list<LocalDb::BlockInfo> LocalDb::GetLiveBlocks(const string &segment)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    list<BlockInfo> result;
+
+    WaitForWrites();
+
+    pthread_mutex_lock(&db_lock);
+    stmt = Prepare("select object, checksum, size, julianday(timestamp) "
+                   "from block_index "
+                   "where segmentid = ? and expired is null "
+                   "order by object");
+    sqlite3_bind_int64(stmt, 1, SegmentToId(segment));
+
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            const char *object
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            const char *checksum
+                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            if (object == NULL)
+                continue;
+
+            BlockInfo block;
+            block.object = object;
+            block.checksum = (checksum != NULL) ? checksum : "";
+            block.size = sqlite3_column_int64(stmt, 2);
+            block.age = sqlite3_column_double(stmt, 3);
+            result.push_back(block);
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else {
+            ReportError(rc);
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
+
+    return result;
+}
+
+/* Mark all objects in a segment as expired, so that no future snapshot will
+ * reference them (matching mark_segment_expired in the Python tools).  Called
+ * by the repacker once fresh copies of the live objects have been stored. */
+void LocalDb::ExpireSegment(const string &segment)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    pthread_mutex_lock(&db_lock);
+    stmt = Prepare("update block_index set expired = 0 where segmentid = ?");
+    sqlite3_bind_int64(stmt, 1, SegmentToId(segment));
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Could not execute UPDATE statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
+}
+
+/* Record a live-byte estimate for a segment under the most recent tracked
+ * snapshot.  Newly-written compacted segments are not referenced by any
+ * snapshot until the next backup runs; attributing their contents to the
+ * latest snapshot keeps database garbage collection from discarding them in
+ * the meantime. */
+void LocalDb::RecordSegmentReferences(const string &segment, int64_t bytes)
 {
     int rc;
     sqlite3_stmt *stmt;
 
+    pthread_mutex_lock(&db_lock);
+    stmt = Prepare("insert or replace into "
+                   "segment_utilization(snapshotid, segmentid, "
+                   "                    bytes_referenced) "
+                   "select max(snapshotid), ?, ? from snapshots");
+    sqlite3_bind_int64(stmt, 1, SegmentToId(segment));
+    sqlite3_bind_int64(stmt, 2, bytes);
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Could not execute INSERT statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
+}
+
+/* Copy subblock chunk signatures from expired objects to unexpired copies of
+ * the same data, so that repacking does not lose the signatures needed for
+ * sub-file incrementals.  Blocks are matched by (checksum, size), the same
+ * identity used for deduplication. */
+void LocalDb::MigrateChunkSignatures()
+{
+    int rc;
+
+    WaitForWrites();
+
+    pthread_mutex_lock(&db_lock);
+    rc = sqlite3_exec(
+        db,
+        "insert or ignore into "
+        "subblock_signatures(blockid, algorithm, signatures) "
+        "select live.blockid, s.algorithm, s.signatures "
+        "from block_index dead "
+        "    join subblock_signatures s on s.blockid = dead.blockid "
+        "    join block_index live "
+        "        on live.checksum = dead.checksum and live.size = dead.size "
+        "where dead.expired is not null and live.expired is null "
+        "    and live.blockid not in "
+        "        (select blockid from subblock_signatures)",
+        NULL, NULL, NULL
+    );
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Could not migrate subblock signatures!\n");
+        ReportError(rc);
+    }
+
+    /* Re-point the chunk index at the surviving copies in the same way, then
+     * drop entries whose blocks no longer have an unexpired copy. */
+    rc = sqlite3_exec(
+        db,
+        "insert into chunk_index(hash, blockid, offset, length) "
+        "select c.hash, live.blockid, c.offset, c.length "
+        "from block_index dead "
+        "    join chunk_index c on c.blockid = dead.blockid "
+        "    join block_index live "
+        "        on live.checksum = dead.checksum and live.size = dead.size "
+        "where dead.expired is not null and live.expired is null "
+        "    and live.blockid not in "
+        "        (select distinct blockid from chunk_index)",
+        NULL, NULL, NULL
+    );
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(
+            db,
+            "delete from chunk_index where blockid not in "
+            "    (select blockid from block_index where expired is null)",
+            NULL, NULL, NULL
+        );
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Could not migrate chunk index entries!\n");
+        ReportError(rc);
+    }
+    pthread_mutex_unlock(&db_lock);
+}
+
+/* Queue a record that an object is referenced by the current snapshot. */
+void LocalDb::UseObject(const ObjectReference& ref)
+{
     if (!ref.is_normal())
         return;
 
+    PendingWrite op;
+    op.type = PendingWrite::USE_OBJECT;
+    op.ref = ref;
+    Enqueue(op);
+}
+
+void LocalDb::ExecUseObject(const ObjectReference& ref)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
     int64_t old_size = 0;
     stmt = Prepare("select size from snapshot_refs "
                    "where segmentid = ? and object = ?");
@@ -494,6 +1297,7 @@ void LocalDb::SetSegmentMetadata(const std::string &segment,
     int rc;
     sqlite3_stmt *stmt;
 
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("update segments set path = ?, checksum = ?, "
                    "type = ?, data_size = ?, disk_size = ?, "
                    "timestamp = coalesce(julianday(timestamp), "
@@ -516,6 +1320,7 @@ void LocalDb::SetSegmentMetadata(const std::string &segment,
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 }
 
 map<string, string> LocalDb::GetSegmentMetadata(const string &segment)
@@ -524,12 +1329,15 @@ map<string, string> LocalDb::GetSegmentMetadata(const string &segment)
     sqlite3_stmt *stmt;
     map<string, string> info;
 
+    WaitForWrites();
+
     // Names in the returned map, in the order returned from the select
     // statement below.
     static const char *fields[] = {
         "datetime", "path", "checksum", "data_size", "disk_size", "type", NULL
     };
 
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("select datetime(timestamp), path, checksum, "
                    "    data_size, disk_size, type "
                    "from segments where segment = ?");
@@ -551,6 +1359,7 @@ map<string, string> LocalDb::GetSegmentMetadata(const string &segment)
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 
     return info;
 }
@@ -567,6 +1376,7 @@ bool LocalDb::LoadChunkSignatures(ObjectReference ref,
     sqlite3_stmt *stmt;
     int found = false;
 
+    pthread_mutex_lock(&db_lock);
     stmt = Prepare("select signatures, algorithm from subblock_signatures "
                    "where blockid = (select blockid from block_index "
                    "                 where segmentid = ? and object = ?)");
@@ -594,15 +1404,53 @@ bool LocalDb::LoadChunkSignatures(ObjectReference ref,
     }
 
     sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
 
     return found;
 }
 
-/* Store the subblock chunk signatures for a specified object.  The object
- * itself must have already been indexed in the database. */
+/* Queue the subblock chunk signatures for a specified object to be stored.
+ * The object itself must have been passed to StoreObject already; the queue
+ * preserves that ordering. */
 void LocalDb::StoreChunkSignatures(ObjectReference ref,
                                    const void *buf, size_t len,
                                    const string& algorithm)
+{
+    /* Make the chunks visible to FindChunk at once, so that duplicate chunks
+     * later in the same backup run are matched without waiting on the writer
+     * thread.  The first copy of a chunk stored wins. */
+    size_t hash_size = algorithm_hash_size(algorithm);
+    if (hash_size > 0) {
+        const char *packed = static_cast<const char *>(buf);
+        size_t record_size = 2 + hash_size;
+        int64_t offset = 0;
+        for (size_t i = 0; i + record_size <= len; i += record_size) {
+            uint16_t chunk_len;
+            memcpy(&chunk_len, &packed[i], 2);
+            chunk_len = ntohs(chunk_len);
+
+            ObjectReference chunk_ref = ref.base();
+            chunk_ref.set_range(offset, chunk_len);
+            chunk_lookup.insert(
+                std::make_pair(ChunkLookupKey(algorithm,
+                                              string(&packed[i + 2],
+                                                     hash_size)),
+                               chunk_ref));
+            offset += chunk_len;
+        }
+    }
+
+    PendingWrite op;
+    op.type = PendingWrite::STORE_SIGNATURES;
+    op.ref = ref;
+    op.data = string(static_cast<const char *>(buf), len);
+    op.algorithm = algorithm;
+    Enqueue(op);
+}
+
+void LocalDb::ExecStoreChunkSignatures(const ObjectReference &ref,
+                                       const string &data,
+                                       const string &algorithm)
 {
     int rc;
     sqlite3_stmt *stmt;
@@ -629,7 +1477,7 @@ void LocalDb::StoreChunkSignatures(ObjectReference ref,
     sqlite3_bind_int64(stmt, 1, blockid);
     sqlite3_bind_text(stmt, 2, algorithm.c_str(), algorithm.size(),
                       SQLITE_TRANSIENT);
-    sqlite3_bind_blob(stmt, 3, buf, len, SQLITE_TRANSIENT);
+    sqlite3_bind_blob(stmt, 3, data.data(), data.size(), SQLITE_TRANSIENT);
 
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
@@ -638,4 +1486,57 @@ void LocalDb::StoreChunkSignatures(ObjectReference ref,
     }
 
     sqlite3_finalize(stmt);
+
+    InsertChunkIndex(blockid, data, algorithm);
+}
+
+/* Search all indexed chunk signatures for a chunk with the given hash.
+ * Returns a reference selecting the chunk's bytes within the object holding
+ * it, or a null reference if no unexpired copy exists. */
+ObjectReference LocalDb::FindChunk(const string &hash,
+                                   const string &algorithm)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+    ObjectReference ref;
+
+    string key = ChunkLookupKey(algorithm, hash);
+    std::unordered_map<string, ObjectReference>::const_iterator i
+        = chunk_lookup.find(key);
+    if (i != chunk_lookup.end())
+        return i->second;
+
+    MetricsTimer db_timer(METRICS_DB);
+    pthread_mutex_lock(&db_lock);
+    stmt = Prepare("select b.segmentid, b.object, c.offset, c.length "
+                   "from chunk_index c "
+                   "    join block_index b on b.blockid = c.blockid "
+                   "    join subblock_signatures s on s.blockid = c.blockid "
+                   "where c.hash = ? and s.algorithm = ? "
+                   "    and b.expired is null limit 1");
+    sqlite3_bind_blob(stmt, 1, hash.data(), hash.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, algorithm.c_str(), algorithm.size(),
+                      SQLITE_TRANSIENT);
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+    } else if (rc == SQLITE_ROW) {
+        ref = ObjectReference(IdToSegment(sqlite3_column_int64(stmt, 0)),
+                              (const char *)sqlite3_column_text(stmt, 1));
+        ref.set_range(sqlite3_column_int64(stmt, 2),
+                      sqlite3_column_int64(stmt, 3));
+    } else {
+        fprintf(stderr, "Could not execute SELECT statement!\n");
+        ReportError(rc);
+    }
+
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db_lock);
+
+    /* Cache hits; misses are not cached since a newly-stored chunk will be
+     * entered into chunk_lookup by StoreChunkSignatures anyway. */
+    if (!ref.is_null())
+        chunk_lookup[key] = ref;
+
+    return ref;
 }
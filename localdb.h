@@ -29,18 +29,52 @@
 #ifndef _LBS_LOCALDB_H
 #define _LBS_LOCALDB_H
 
+#include <pthread.h>
 #include <sqlite3.h>
 
+#include <list>
 #include <set>
 #include <string>
+#include <unordered_map>
 
 #include "ref.h"
 
 class LocalDb {
 public:
+    /* Per-segment statistics used by the segment repacker (cumulus-repack).
+     * bytes_referenced is the live-byte estimate maintained from the UseObject
+     * calls of past snapshots (the maximum over all tracked snapshots). */
+    struct SegmentStats {
+        std::string name;
+        std::string type;           // Object group ("data", "compacted-N", ...)
+        int64_t data_size;          // Uncompressed bytes of object data
+        int64_t disk_size;          // Size of the segment file on disk
+        int64_t bytes_referenced;
+        double age_days;
+    };
+
+    /* A live object within a segment, for repacking. */
+    struct BlockInfo {
+        std::string object;         // Sequence number within the segment
+        std::string checksum;
+        int64_t size;
+        double age;                 // Timestamp, in Julian days
+    };
+
+    /* A snapshot tracked in the snapshots table. */
+    struct SnapshotInfo {
+        std::string scheme;
+        std::string name;
+    };
+
     void Open(const char *path, const char *snapshot_name,
               const char *snapshot_scheme);
     void Close();
+
+    /* Flush all queued writes and commit the enclosing transaction, so that
+     * everything recorded so far survives an interrupted backup.  Called
+     * when checkpointing, after all completed segments have been uploaded. */
+    void Checkpoint();
     void StoreObject(const ObjectReference& ref, double age);
     ObjectReference FindObject(const std::string &checksum, int64_t size);
     bool IsOldObject(const std::string &checksum, int64_t size, double *age,
@@ -49,6 +83,12 @@ public:
     void UseObject(const ObjectReference& ref);
 
     std::set<std::string> GetUsedSegments();
+    std::list<SnapshotInfo> GetSnapshots();
+    std::list<SegmentStats> GetSegmentStatistics();
+    std::list<BlockInfo> GetLiveBlocks(const std::string &segment);
+    void ExpireSegment(const std::string &segment);
+    void RecordSegmentReferences(const std::string &segment, int64_t bytes);
+    void MigrateChunkSignatures();
     void SetSegmentMetadata(const std::string &segment, const std::string &path,
                             const std::string &checksum,
                             const std::string &type, int data_size,
@@ -62,14 +102,86 @@ public:
     void StoreChunkSignatures(ObjectReference ref,
                               const void *buf, size_t len,
                               const std::string &algorithm);
+
+    /* Look up a single subfile chunk by its hash, across all objects which
+     * have chunk signatures stored.  Returns a reference (with a byte range
+     * covering just the chunk) if a copy of the chunk exists in an unexpired
+     * object, or a null reference otherwise. */
+    ObjectReference FindChunk(const std::string &hash,
+                              const std::string &algorithm);
 private:
+    /* A database write queued for execution by the background writer thread.
+     * The writer executes operations in the order they were enqueued and
+     * commits the enclosing transaction periodically (group commit), so that
+     * the backup thread never waits on SQLite and an interrupted backup
+     * retains most of its bookkeeping. */
+    struct PendingWrite {
+        enum WriteType { STORE_OBJECT, USE_OBJECT, STORE_SIGNATURES } type;
+        ObjectReference ref;
+        double age;                 // STORE_OBJECT only
+        std::string data;           // STORE_SIGNATURES: packed signatures
+        std::string algorithm;      // STORE_SIGNATURES only
+    };
+
     sqlite3 *db;
     int64_t snapshotid;
+    int lock_fd;                // Shared advisory lock held while running
+
+    /* In-memory index of the block_index table, keyed by (checksum, size), so
+     * that the per-block deduplication lookups in FindObject do not need a
+     * database round trip.  Loaded once in Open and kept up to date by
+     * StoreObject; lookups fall back to SQL on a miss. */
+    std::unordered_map<std::string, ObjectReference> block_lookup;
+
+    /* Cache of chunk hash -> object range lookups made through FindChunk,
+     * keyed by (algorithm, hash).  Populated from the chunk_index table on
+     * demand, and updated immediately by StoreChunkSignatures so that
+     * duplicate chunks within a single backup run are found without touching
+     * the database.  Only accessed from the main thread, like block_lookup. */
+    std::unordered_map<std::string, ObjectReference> chunk_lookup;
+
+    // Interned segment names: segment name <-> segmentid mappings are
+    // immutable once created, so cache them and avoid a database query per
+    // reference.  Only accessed with db_lock held.
+    std::unordered_map<std::string, int64_t> segment_id_cache;
+    std::unordered_map<int64_t, std::string> segment_name_cache;
+
+    /* State shared with the background writer thread.  db_lock serializes all
+     * use of the SQLite connection; queue_lock protects the write queue. */
+    pthread_t writer;
+    pthread_mutex_t db_lock;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    std::list<PendingWrite> write_queue;
+    bool writer_terminate;
+    int writes_uncommitted;     // Writes executed since the last commit
+    bool txn_open;              // Transaction open on the connection
+                                //   (guarded by db_lock)
 
     sqlite3_stmt *Prepare(const char *sql);
     void ReportError(int rc);
     int64_t SegmentToId(const std::string &segment);
     std::string IdToSegment(int64_t segmentid);
+
+    void LoadBlockIndex();
+    static std::string BlockLookupKey(const std::string &checksum,
+                                      int64_t size);
+
+    void EnsureChunkIndex();
+    static std::string ChunkLookupKey(const std::string &algorithm,
+                                      const std::string &hash);
+    void InsertChunkIndex(int64_t blockid, const std::string &data,
+                          const std::string &algorithm);
+
+    void Enqueue(const PendingWrite &op);
+    void WaitForWrites();
+    void WriterThread();
+    static void *StartWriterThread(void *arg);
+    void ExecStoreObject(const ObjectReference &ref, double age);
+    void ExecUseObject(const ObjectReference &ref);
+    void ExecStoreChunkSignatures(const ObjectReference &ref,
+                                  const std::string &data,
+                                  const std::string &algorithm);
 };
 
 #endif // _LBS_LOCALDB_H
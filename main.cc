@@ -20,6 +20,7 @@
 /* Main entry point for Cumulus.  Contains logic for traversing the filesystem
  * and constructing a backup. */
 
+#include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -30,6 +31,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
@@ -51,14 +54,18 @@
 #include "hash.h"
 #include "localdb.h"
 #include "metadata.h"
+#include "metrics.h"
 #include "remote.h"
 #include "store.h"
 #include "subfile.h"
 #include "util.h"
+#include "third_party/chunk.h"
 #include "third_party/sha1.h"
 
 using std::list;
+using std::make_pair;
 using std::map;
+using std::pair;
 using std::string;
 using std::vector;
 using std::ostream;
@@ -88,12 +95,59 @@ PathFilterList filter_rules;
 
 bool flag_rebuild_statcache = false;
 
+/* Paths reported as changed by an external change journal (--changed-paths).
+ * When the flag is set, directory subtrees containing none of these paths are
+ * not walked at all; their metadata is re-emitted from the previous backup's
+ * statcache. */
+static std::set<string> changed_paths;
+static bool flag_changed_paths = false;
+
+/* Number of worker threads used to hash file data.  A value of 1 selects the
+ * original, fully-synchronous code path. */
+static int num_threads = 1;
+
+/* Number of concurrent uploads to the remote storage layer. */
+static int num_transfer_threads = 1;
+
+/* Number of upcoming small files to open and issue readahead for, ahead of
+ * the dump loop (--prefetch-depth; 0 disables).  With only the synchronous
+ * per-file open/read/close sequence the disk sees a single outstanding
+ * request at a time, which on maildir-style trees of tiny files leaves most
+ * of the device's command queue idle.  Opening a window of files early and
+ * handing them to the kernel with posix_fadvise(WILLNEED) keeps a batch of
+ * reads in flight, so the dump loop mostly reads from the page cache.  The
+ * count of open descriptors is global so that recursion into subdirectories
+ * shares one budget. */
+static int prefetch_depth = 64;
+static int prefetch_open_count = 0;
+
+/* Process each directory's entries ordered by inode number instead of by
+ * name (--scan-order=inode).  Inode numbers roughly track on-disk layout, so
+ * on rotating storage this turns the near-random seek pattern of a
+ * name-ordered walk into a mostly sequential one.  The inode numbers come
+ * straight from readdir, so the mode costs nothing extra; lookups in the
+ * statcache go through its hash index and do not care about traversal order,
+ * and entries below a directory stay contiguous in the metadata log. */
+static bool flag_inode_order = false;
+
+/* Checkpoint the backup every this many seconds (--checkpoint-interval;
+ * 0 disables checkpointing).  A checkpoint flushes buffered metadata, closes
+ * and uploads all open segments, and commits the local database, so that a
+ * backup restarted after an interruption can skip the files already
+ * processed instead of redoing the whole run. */
+static int checkpoint_interval = 0;
+static time_t last_checkpoint = 0;
+
 /* Whether verbose output is enabled. */
 bool verbose = false;
 
 /* Attempts to open a regular file read-only, but with safety checks for files
- * that might not be fully trusted. */
-int safe_open(const string& path, struct stat *stat_buf)
+ * that might not be fully trusted.  The file is named relative to an open
+ * directory file descriptor (or AT_FDCWD), so the kernel does not need to
+ * re-resolve the leading directory chain; path is the full name used only
+ * for error messages. */
+int safe_open(int dirfd, const string& relname, const string& path,
+              struct stat *stat_buf)
 {
     int fd;
 
@@ -109,9 +163,10 @@ int safe_open(const string& path, struct stat *stat_buf)
      * We also add in O_NOATIME, since this may reduce disk writes (for
      * inode updates).  However, O_NOATIME may result in EPERM, so if the
      * initial open fails, try again without O_NOATIME.  */
-    fd = open(path.c_str(), O_RDONLY|O_NOATIME|O_NOFOLLOW|O_NONBLOCK);
+    fd = openat(dirfd, relname.c_str(),
+                O_RDONLY|O_NOATIME|O_NOFOLLOW|O_NONBLOCK);
     if (fd < 0) {
-        fd = open(path.c_str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+        fd = openat(dirfd, relname.c_str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
     }
     if (fd < 0) {
         fprintf(stderr, "Unable to open file %s: %m\n", path.c_str());
@@ -172,6 +227,261 @@ ssize_t file_read(int fd, char *buf, size_t maxlen)
     return bytes_read;
 }
 
+/* A parallel pipeline for processing file data.  A dedicated reader thread
+ * fills a bounded ring of block-sized buffers from the current file, a pool of
+ * worker threads computes block checksums (and scans for all-zero blocks), and
+ * the main backup thread consumes the blocks in file order.  Database lookups
+ * and segment writes remain on the main thread, so the local database and
+ * TarSegmentStore do not need to be thread-safe.  The pipeline overlaps file
+ * reading and hashing with deduplication and segment output. */
+class BlockPipeline {
+public:
+    /* A single block of file data flowing through the pipeline. */
+    struct Block {
+        char *buf;              // Buffer holding the block contents
+        ssize_t len;            // Bytes in buffer; 0 at end of file, -1 on
+                                //   read error
+        bool all_zero;          // Is the block entirely zero bytes?
+        std::string csum;       // Block checksum (Hash::digest_str format)
+
+        enum { BLOCK_EMPTY, BLOCK_FILLED, BLOCK_HASHING, BLOCK_READY } state;
+    };
+
+    BlockPipeline(int nworkers);
+    ~BlockPipeline();
+
+    // Start reading a new file.  All blocks from the previous file must have
+    // been consumed and released.
+    void start(int fd);
+
+    // Return the next block of the current file, in order, with the checksum
+    // already computed.  Blocks with len <= 0 signal end-of-file (or a read
+    // error) and are the last block returned for a file.
+    Block *next();
+
+    // Return a block to the pipeline once the caller is done with its buffer.
+    void release(Block *block);
+
+private:
+    // Number of buffers in flight; keep a few more than the worker count so
+    // that neither the reader nor the workers stall needlessly.
+    static const int RING_SLACK = 2;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    int nworkers;
+    std::vector<pthread_t> threads;     // Workers, plus the reader thread
+    Block *ring;
+    int ring_size;
+
+    int fd;                     // File currently being read
+    bool reading;               // Reader thread has more blocks to produce
+    bool terminate;             // Set when threads should shut down
+    uint64_t read_seq;          // Sequence number of next block to read
+    uint64_t consume_seq;       // Sequence number of next block to consume
+
+    Block *slot(uint64_t seq) { return &ring[seq % ring_size]; }
+
+    void reader_thread();
+    void worker_thread();
+    static void *start_reader_thread(void *arg);
+    static void *start_worker_thread(void *arg);
+};
+
+static BlockPipeline *pipeline = NULL;
+
+BlockPipeline::BlockPipeline(int nworkers)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    this->nworkers = nworkers;
+    ring_size = nworkers + RING_SLACK;
+    ring = new Block[ring_size];
+    for (int i = 0; i < ring_size; i++) {
+        ring[i].buf = new char[LBS_BLOCK_SIZE];
+        ring[i].state = Block::BLOCK_EMPTY;
+    }
+
+    fd = -1;
+    reading = false;
+    terminate = false;
+    read_seq = consume_seq = 0;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, BlockPipeline::start_reader_thread,
+                       (void *)this) != 0)
+        fatal("Cannot create pipeline reader thread");
+    threads.push_back(thread);
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&thread, NULL, BlockPipeline::start_worker_thread,
+                           (void *)this) != 0)
+            fatal("Cannot create pipeline worker thread");
+        threads.push_back(thread);
+    }
+}
+
+BlockPipeline::~BlockPipeline()
+{
+    pthread_mutex_lock(&lock);
+    terminate = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < ring_size; i++)
+        delete[] ring[i].buf;
+    delete[] ring;
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void BlockPipeline::start(int fd)
+{
+    pthread_mutex_lock(&lock);
+    assert(!reading && read_seq == consume_seq);
+    this->fd = fd;
+    reading = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+BlockPipeline::Block *BlockPipeline::next()
+{
+    pthread_mutex_lock(&lock);
+    Block *block = slot(consume_seq);
+    while (block->state != Block::BLOCK_READY)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+    return block;
+}
+
+void BlockPipeline::release(Block *block)
+{
+    pthread_mutex_lock(&lock);
+    assert(block == slot(consume_seq));
+    block->state = Block::BLOCK_EMPTY;
+    block->csum.clear();
+    consume_seq++;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Reader thread: sequentially fill empty ring slots with data from the current
+ * file.  The final block produced for each file has len <= 0. */
+void BlockPipeline::reader_thread()
+{
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (!terminate
+               && (!reading || slot(read_seq)->state != Block::BLOCK_EMPTY))
+            pthread_cond_wait(&cond, &lock);
+        if (terminate)
+            break;
+
+        Block *block = slot(read_seq);
+        pthread_mutex_unlock(&lock);
+        ssize_t bytes;
+        {
+            MetricsTimer read_timer(METRICS_READ);
+            bytes = file_read(fd, block->buf, LBS_BLOCK_SIZE);
+            if (bytes > 0)
+                metrics_add_bytes(METRICS_READ, bytes);
+        }
+        pthread_mutex_lock(&lock);
+
+        block->len = bytes;
+        read_seq++;
+        if (bytes <= 0) {
+            /* End of file (or a read error): hand the terminal block directly
+             * to the consumer and wait for the next file. */
+            block->state = Block::BLOCK_READY;
+            reading = false;
+        } else {
+            block->state = Block::BLOCK_FILLED;
+        }
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Worker threads: checksum filled blocks and check them for all-zero contents.
+ * Blocks may be hashed out of order; the consumer reassembles file order. */
+void BlockPipeline::worker_thread()
+{
+    pthread_mutex_lock(&lock);
+    while (true) {
+        Block *block = NULL;
+        for (uint64_t seq = consume_seq; seq < read_seq; seq++) {
+            if (slot(seq)->state == Block::BLOCK_FILLED) {
+                block = slot(seq);
+                break;
+            }
+        }
+        if (block == NULL) {
+            if (terminate)
+                break;
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+
+        block->state = Block::BLOCK_HASHING;
+        pthread_mutex_unlock(&lock);
+
+        {
+            MetricsTimer hash_timer(METRICS_HASH);
+            block->all_zero = is_all_zero(block->buf, block->len);
+
+            /* All-zero blocks are stored as a zero reference; their checksum
+             * is never consulted, so skip computing it. */
+            if (block->all_zero) {
+                block->csum.clear();
+            } else {
+                scoped_ptr<Hash> block_hash(Hash::New());
+                block_hash->update(block->buf, block->len);
+                block->csum = block_hash->digest_str();
+                metrics_add_bytes(METRICS_HASH, block->len);
+            }
+        }
+
+        pthread_mutex_lock(&lock);
+        block->state = Block::BLOCK_READY;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void *BlockPipeline::start_reader_thread(void *arg)
+{
+    BlockPipeline *p = static_cast<BlockPipeline *>(arg);
+    p->reader_thread();
+    return NULL;
+}
+
+void *BlockPipeline::start_worker_thread(void *arg)
+{
+    BlockPipeline *p = static_cast<BlockPipeline *>(arg);
+    p->worker_thread();
+    return NULL;
+}
+
+/* Cache of hard-linked files already dumped during this run, keyed by
+ * (device, inode).  Later links to the same inode reuse the first link's
+ * checksum and object list directly instead of re-reading and re-hashing the
+ * contents--block deduplication would already avoid storing the data twice,
+ * but not the I/O.  Only multiply-linked inodes are entered, so the cache
+ * stays small on typical trees. */
+struct LinkedFileInfo {
+    string checksum;
+    int64_t size;
+    list<ObjectReference> blocks;
+};
+static map<std::pair<dev_t, ino_t>, LinkedFileInfo> linked_file_cache;
+
 /* Read the contents of a file (specified by an open file descriptor) and copy
  * the data to the store.  Returns the size of the file (number of bytes
  * dumped), or -1 on error. */
@@ -179,7 +489,7 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
                  struct stat& stat_buf)
 {
     int64_t size = 0;
-    list<string> object_list;
+    list<ObjectReference> object_list;
     const char *status = NULL;          /* Status indicator printed out */
 
     /* Look up this file in the old stat cache, if we can.  If the stat
@@ -217,13 +527,35 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
             for (list<ObjectReference>::const_iterator i = old_blocks.begin();
                  i != old_blocks.end(); ++i) {
                 const ObjectReference &ref = *i;
-                object_list.push_back(ref.to_string());
+                object_list.push_back(ref);
                 db->UseObject(ref);
             }
             size = stat_buf.st_size;
         }
     }
 
+    /* If this is one of several links to an inode another link already
+     * dumped this run, reuse that link's results without reading the file.
+     * All links share stat information, so whenever this file would have to
+     * be re-read, the first link was re-read too. */
+    std::pair<dev_t, ino_t> link_key(stat_buf.st_dev, stat_buf.st_ino);
+    if (!cached && stat_buf.st_nlink > 1) {
+        map<std::pair<dev_t, ino_t>, LinkedFileInfo>::const_iterator l
+            = linked_file_cache.find(link_key);
+        if (l != linked_file_cache.end()) {
+            cached = true;
+            file_info["checksum"] = l->second.checksum;
+            size = l->second.size;
+            for (list<ObjectReference>::const_iterator i
+                     = l->second.blocks.begin();
+                 i != l->second.blocks.end(); ++i) {
+                object_list.push_back(*i);
+                db->UseObject(*i);
+            }
+            status = "linked";
+        }
+    }
+
     /* If the file is new or changed, we must read in the contents a block at a
      * time. */
     if (!cached) {
@@ -231,25 +563,115 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
         Subfile subfile(db);
         subfile.load_old_blocks(old_blocks);
 
+        /* For large regular files, map the contents into memory instead of
+         * reading them into block_buf: hashing and sub-file analysis then
+         * operate directly on the page cache, and with MADV_SEQUENTIAL the
+         * kernel prefetches ahead of the hash loop.  Fall back to read() if
+         * the mapping fails (unusual filesystems, special files).  If another
+         * process truncates the file while it is mapped we could fault, but
+         * files are not expected to shrink mid-backup.  The threaded read
+         * pipeline has its own buffers and does not use the mapping. */
+        char *map_base = NULL;
+        size_t map_len = 0;
+        size_t map_offset = 0;
+        if (pipeline == NULL && S_ISREG(stat_buf.st_mode)
+            && stat_buf.st_size > (int64_t)LBS_BLOCK_SIZE) {
+            void *m = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED,
+                           fd, 0);
+            if (m != MAP_FAILED) {
+                map_base = (char *)m;
+                map_len = stat_buf.st_size;
+                madvise(map_base, map_len, MADV_SEQUENTIAL);
+            }
+        }
+
+        if (pipeline != NULL)
+            pipeline->start(fd);
+
+        /* With a mapped file, consult SEEK_DATA to recognize holes: blocks
+         * falling entirely within a hole are known to be zero without
+         * scanning them, so sparse images are processed at the speed of the
+         * file-level hash alone. */
+        bool seek_data_ok = (map_base != NULL);
+        off_t next_data = 0;
+
         while (true) {
-            ssize_t bytes = file_read(fd, block_buf, LBS_BLOCK_SIZE);
-            if (bytes == 0)
+            BlockPipeline::Block *block = NULL;
+            const char *block_data;
+            ssize_t bytes;
+            bool all_zero = false;
+            bool known_hole = false;
+            string block_csum;
+
+            if (pipeline != NULL) {
+                block = pipeline->next();
+                block_data = block->buf;
+                bytes = block->len;
+                all_zero = block->all_zero;
+                block_csum = block->csum;
+            } else if (map_base != NULL) {
+                block_data = map_base + map_offset;
+                bytes = std::min(map_len - map_offset,
+                                 (size_t)LBS_BLOCK_SIZE);
+
+                if (seek_data_ok && bytes > 0
+                    && (off_t)map_offset >= next_data) {
+                    off_t res = lseek(fd, map_offset, SEEK_DATA);
+                    if (res < 0) {
+                        if (errno == ENXIO) {
+                            /* Only a hole remains through end-of-file. */
+                            next_data = map_len;
+                        } else {
+                            /* SEEK_DATA unsupported on this filesystem. */
+                            seek_data_ok = false;
+                        }
+                    } else {
+                        next_data = res;
+                    }
+                }
+                if (seek_data_ok
+                    && next_data >= (off_t)(map_offset + bytes)) {
+                    known_hole = true;
+                }
+
+                map_offset += bytes;
+            } else {
+                block_data = block_buf;
+                MetricsTimer read_timer(METRICS_READ);
+                bytes = file_read(fd, block_buf, LBS_BLOCK_SIZE);
+                if (bytes > 0)
+                    metrics_add_bytes(METRICS_READ, bytes);
+            }
+            if (bytes == 0) {
+                if (block != NULL)
+                    pipeline->release(block);
                 break;
+            }
             if (bytes < 0) {
                 fprintf(stderr, "Backup contents for %s may be incorrect\n",
                         path.c_str());
+                if (block != NULL)
+                    pipeline->release(block);
                 break;
             }
 
-            file_hash->update(block_buf, bytes);
-
-            // Sparse file processing: if we read a block of all zeroes, encode
-            // that explicitly.
-            bool all_zero = true;
-            for (int i = 0; i < bytes; i++) {
-                if (block_buf[i] != 0) {
-                    all_zero = false;
-                    break;
+            {
+                MetricsTimer hash_timer(METRICS_HASH);
+                metrics_add_bytes(METRICS_HASH, bytes);
+                file_hash->update(block_data, bytes);
+
+                if (pipeline == NULL) {
+                    // Sparse file processing: if we read a block of all
+                    // zeroes, encode that explicitly.  Blocks inside a
+                    // filesystem hole are zero by definition and need not be
+                    // scanned.
+                    all_zero = known_hole || is_all_zero(block_data, bytes);
+
+                    if (!all_zero) {
+                        scoped_ptr<Hash> block_hash(Hash::New());
+                        block_hash->update(block_data, bytes);
+                        block_csum = block_hash->digest_str();
+                    }
                 }
             }
 
@@ -258,10 +680,6 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
             double block_age = 0.0;
             ObjectReference ref;
 
-            scoped_ptr<Hash> block_hash(Hash::New());
-            block_hash->update(block_buf, bytes);
-            string block_csum = block_hash->digest_str();
-
             if (all_zero) {
                 ref = ObjectReference(ObjectReference::REF_ZERO);
                 ref.set_range(0, bytes);
@@ -302,11 +720,11 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
                     status = "new";
                 }
 
-                subfile.analyze_new_block(block_buf, bytes);
+                subfile.analyze_new_block(block_data, bytes);
                 refs = subfile.create_incremental(tss, o, block_age);
             } else {
                 if (flag_rebuild_statcache && ref.is_normal()) {
-                    subfile.analyze_new_block(block_buf, bytes);
+                    subfile.analyze_new_block(block_data, bytes);
                     subfile.store_analyzed_signatures(ref);
                 }
                 refs.push_back(ref);
@@ -320,15 +738,21 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
                 // individual objects.
                 ref.clear_checksum();
 
-                object_list.push_back(ref.to_string());
+                object_list.push_back(ref);
                 db->UseObject(ref);
             }
             size += bytes;
 
+            if (block != NULL)
+                pipeline->release(block);
+
             if (status == NULL)
                 status = "old";
         }
 
+        if (map_base != NULL)
+            munmap(map_base, map_len);
+
         file_info["checksum"] = file_hash->digest_str();
     }
 
@@ -350,12 +774,25 @@ int64_t dumpfile(int fd, dictionary &file_info, const string &path,
     if (verbose && status != NULL)
         printf("    [%s]\n", status);
 
+    /* Remember the results for multiply-linked inodes so that the remaining
+     * links can reuse them. */
+    if (stat_buf.st_nlink > 1
+        && linked_file_cache.find(link_key) == linked_file_cache.end()) {
+        LinkedFileInfo info;
+        info.checksum = file_info["checksum"];
+        info.size = size;
+        info.blocks = object_list;
+        linked_file_cache[link_key] = info;
+    }
+
+    /* References are kept in binary form on the hot path above; they are
+     * only formatted as text here, when the metadata entry is built. */
     string blocklist = "";
-    for (list<string>::iterator i = object_list.begin();
+    for (list<ObjectReference>::iterator i = object_list.begin();
          i != object_list.end(); ++i) {
         if (i != object_list.begin())
             blocklist += "\n    ";
-        blocklist += *i;
+        blocklist += i->to_string();
     }
     file_info["data"] = blocklist;
 
@@ -400,6 +837,8 @@ string group_to_string(gid_t gid) {
  * provided. */
 void dump_inode(const string& path,         // Path within snapshot
                 const string& fullpath,     // Path to object in filesystem
+                int dirfd,                  // Directory filehandle for *at
+                const string& relname,      // Name relative to dirfd
                 struct stat& stat_buf,      // Results of stat() call
                 int fd)                     // Open filehandle if regular file
 {
@@ -454,9 +893,10 @@ void dump_inode(const string& path,         // Path within snapshot
          * the symlink.  Allocate slightly more space, so that we ask for more
          * bytes than we expect and so check for truncation. */
         buf = new char[stat_buf.st_size + 2];
-        len = readlink(fullpath.c_str(), buf, stat_buf.st_size + 1);
+        len = readlinkat(dirfd, relname.c_str(), buf, stat_buf.st_size + 1);
         if (len < 0) {
-            fprintf(stderr, "error reading symlink: %m\n");
+            fprintf(stderr, "error reading symlink %s: %m\n",
+                    fullpath.c_str());
         } else if (len <= stat_buf.st_size) {
             buf[len] = '\0';
             file_info["target"] = uri_encode(buf);
@@ -509,14 +949,15 @@ string metafile_path(const string& path)
     return newpath;
 }
 
-void try_merge_filter(const string& path, const string& basedir)
+void try_merge_filter(int dirfd, const string& relname, const string& path,
+                      const string& basedir)
 {
     struct stat stat_buf;
-    if (lstat(path.c_str(), &stat_buf) < 0)
+    if (fstatat(dirfd, relname.c_str(), &stat_buf, AT_SYMLINK_NOFOLLOW) < 0)
         return;
     if ((stat_buf.st_mode & S_IFMT) != S_IFREG)
         return;
-    int fd = safe_open(path, NULL);
+    int fd = safe_open(dirfd, relname, path, NULL);
     if (fd < 0)
         return;
 
@@ -535,7 +976,48 @@ void try_merge_filter(const string& path, const string& basedir)
                                 string(block_buf, bytes));
 }
 
-void scanfile(const string& path)
+/* Does the change journal list any path at or below the given directory
+ * (named in metadata-log form)?  The set is sorted, so one lower_bound finds
+ * both an exact match and the first entry with the directory as a prefix. */
+static bool subtree_has_changes(const string& path)
+{
+    string prefix = (path == ".") ? "" : path + "/";
+    std::set<string>::const_iterator i = changed_paths.lower_bound(path);
+    if (i != changed_paths.end() && *i == path)
+        return true;
+    i = changed_paths.lower_bound(prefix);
+    return (i != changed_paths.end()
+            && i->compare(0, prefix.size(), prefix) == 0);
+}
+
+/* If the checkpoint interval has elapsed, bring the on-disk state up to date
+ * with the scan so far: flush buffered metadata, close all open segments and
+ * wait for their uploads, and only then commit the local database, so that
+ * the committed state never references a segment that was not stored.
+ * Called between files, never in the middle of dumping one. */
+static void checkpoint_if_due()
+{
+    if (checkpoint_interval <= 0)
+        return;
+    if (time(NULL) - last_checkpoint < checkpoint_interval)
+        return;
+
+    metawriter->checkpoint();
+    tss->sync();
+    remote->sync();
+    db->Checkpoint();
+
+    last_checkpoint = time(NULL);
+}
+
+/* Scan a filesystem object and back it up, recursing into directories.  The
+ * object is named relative to an open directory file descriptor (AT_FDCWD
+ * for the top-level paths) so that the kernel resolves a single name per
+ * syscall instead of re-walking the full directory chain for every entry;
+ * the path string is carried along only for metadata output and error
+ * messages. */
+void scanfile(int dirfd, const string& relname, const string& path,
+              int prefetch_fd = -1)
 {
     int fd = -1;
     struct stat stat_buf;
@@ -543,49 +1025,106 @@ void scanfile(const string& path)
 
     string output_path = metafile_path(path);
 
-    if (lstat(path.c_str(), &stat_buf) < 0) {
-        fprintf(stderr, "lstat(%s): %m\n", path.c_str());
-        return;
+    if (prefetch_fd >= 0) {
+        /* The parent directory's prefetch loop already opened the file and
+         * started readahead on it.  An fstat on the open descriptor replaces
+         * the fstatat/safe_open/fstat sequence, and is immune to the file
+         * being renamed or replaced in the meantime. */
+        MetricsTimer t(METRICS_STAT);
+        if (fstat(prefetch_fd, &stat_buf) < 0) {
+            fprintf(stderr, "fstat(%s): %m\n", path.c_str());
+            close(prefetch_fd);
+            return;
+        }
+        if ((stat_buf.st_mode & S_IFMT) != S_IFREG) {
+            /* The name no longer refers to the regular file that was
+             * prefetched; fall back to the normal path below. */
+            close(prefetch_fd);
+            prefetch_fd = -1;
+        }
+    }
+
+    if (prefetch_fd >= 0) {
+        fd = prefetch_fd;
+    } else {
+        MetricsTimer t(METRICS_STAT);
+        if (fstatat(dirfd, relname.c_str(), &stat_buf,
+                    AT_SYMLINK_NOFOLLOW) < 0) {
+            fprintf(stderr, "lstat(%s): %m\n", path.c_str());
+            return;
+        }
     }
 
     bool is_directory = ((stat_buf.st_mode & S_IFMT) == S_IFDIR);
-    if (!filter_rules.is_included(output_path, is_directory))
+    if (!filter_rules.is_included(output_path, is_directory)) {
+        if (fd >= 0)
+            close(fd);
         return;
+    }
 
-    if ((stat_buf.st_mode & S_IFMT) == S_IFREG) {
-        fd = safe_open(path, &stat_buf);
+    if ((stat_buf.st_mode & S_IFMT) == S_IFREG && fd < 0) {
+        fd = safe_open(dirfd, relname, path, &stat_buf);
         if (fd < 0)
             return;
     }
 
-    dump_inode(output_path, path, stat_buf, fd);
+    dump_inode(output_path, path, dirfd, relname, stat_buf, fd);
 
     if (fd >= 0)
         close(fd);
 
+    checkpoint_if_due();
+
     /* If we hit a directory, now that we've written the directory itself,
-     * recursively scan the directory. */
+     * recursively scan the directory.  The directory file descriptor is kept
+     * open across the recursion so children are opened relative to it. */
     if (is_directory) {
-        DIR *dir = opendir(path.c_str());
-
-        if (dir == NULL) {
-            fprintf(stderr, "Error reading directory %s: %m\n",
-                    path.c_str());
+        /* If an external change journal says nothing below this directory was
+         * touched, skip reading it entirely: the entries from the previous
+         * snapshot are re-emitted from the statcache.  Fall through to a
+         * normal walk if the old metadata cannot be reused. */
+        if (flag_changed_paths && !subtree_has_changes(output_path)
+            && metawriter->reuse_subtree(output_path)) {
+            if (verbose)
+                printf("Skipping unchanged subtree %s\n", path.c_str());
             return;
         }
 
-        struct dirent *ent;
         vector<string> contents;
-        while ((ent = readdir(dir)) != NULL) {
-            string filename(ent->d_name);
-            if (filename == "." || filename == "..")
-                continue;
-            contents.push_back(filename);
-        }
+        vector<pair<uint64_t, string> > inode_order;
+        DIR *dir;
+        int dfd;
+        {
+            MetricsTimer traverse_timer(METRICS_TRAVERSE);
+            dfd = openat(dirfd, relname.c_str(),
+                         O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+            if (dfd < 0) {
+                fprintf(stderr, "Error opening directory %s: %m\n",
+                        path.c_str());
+                return;
+            }
+            dir = fdopendir(dfd);
+            if (dir == NULL) {
+                fprintf(stderr, "Error reading directory %s: %m\n",
+                        path.c_str());
+                close(dfd);
+                return;
+            }
 
-        closedir(dir);
+            struct dirent *ent;
+            while ((ent = readdir(dir)) != NULL) {
+                string filename(ent->d_name);
+                if (filename == "." || filename == "..")
+                    continue;
+                contents.push_back(filename);
+                if (flag_inode_order)
+                    inode_order.push_back(make_pair((uint64_t)ent->d_ino,
+                                                    filename));
+            }
 
-        sort(contents.begin(), contents.end());
+            sort(contents.begin(), contents.end());
+            sort(inode_order.begin(), inode_order.end());
+        }
 
         filter_rules.save();
 
@@ -605,24 +1144,83 @@ void scanfile(const string& path)
                     printf("Merging directory filter rules %s\n",
                            filename.c_str());
                 }
-                try_merge_filter(filename, output_path);
+                try_merge_filter(dfd, *i, filename, output_path);
             }
         }
 
         /* Second pass: recursively scan all items in the directory for backup;
-         * scanfile() will check if the item should be included or not. */
-        for (vector<string>::iterator i = contents.begin();
-             i != contents.end(); ++i) {
-            const string& filename = *i;
+         * scanfile() will check if the item should be included or not.
+         *
+         * Small regular files are opened a window ahead of the dump loop and
+         * handed to the kernel for readahead, so that the disk services a
+         * batch of outstanding reads rather than one synchronous read per
+         * file.  Prefetched descriptors are passed down to scanfile(), which
+         * takes ownership of them; anything that is not a small regular file
+         * (or that fails to open) simply takes the normal path. */
+        if (flag_inode_order) {
+            /* The name-sorted list was only needed for the filter-merge pass
+             * above; dump (and prefetch) the entries in inode order. */
+            contents.clear();
+            for (size_t i = 0; i < inode_order.size(); i++)
+                contents.push_back(inode_order[i].second);
+        }
+
+        map<string, int> prefetched;
+        size_t prefetch_next = 0;
+        for (size_t idx = 0; idx < contents.size(); idx++) {
+            /* If deeper recursion consumed the whole descriptor budget for a
+             * while, the window may not have kept up; never prefetch entries
+             * the loop has already passed. */
+            if (prefetch_next < idx)
+                prefetch_next = idx;
+
+            while (prefetch_next < contents.size()
+                   && prefetch_open_count < prefetch_depth) {
+                const string& name = contents[prefetch_next++];
+                struct stat prefetch_stat;
+                if (fstatat(dfd, name.c_str(), &prefetch_stat,
+                            AT_SYMLINK_NOFOLLOW) < 0
+                    || !S_ISREG(prefetch_stat.st_mode)
+                    || prefetch_stat.st_size > (int64_t)LBS_BLOCK_SIZE)
+                    continue;
+
+                /* Use the same open flags as safe_open; O_NONBLOCK has no
+                 * effect on regular-file reads, so there is no need to clear
+                 * it again afterwards. */
+                int pfd = openat(dfd, name.c_str(),
+                                 O_RDONLY|O_NOATIME|O_NOFOLLOW|O_NONBLOCK);
+                if (pfd < 0)
+                    pfd = openat(dfd, name.c_str(),
+                                 O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+                if (pfd < 0)
+                    continue;
+
+                posix_fadvise(pfd, 0, 0, POSIX_FADV_WILLNEED);
+                prefetched[name] = pfd;
+                prefetch_open_count++;
+            }
+
+            const string& filename = contents[idx];
+            int pfd = -1;
+            map<string, int>::iterator p = prefetched.find(filename);
+            if (p != prefetched.end()) {
+                pfd = p->second;
+                prefetched.erase(p);
+                prefetch_open_count--;
+            }
+
             if (path == ".")
-                scanfile(filename);
+                scanfile(dfd, filename, filename, pfd);
             else if (path == "/")
-                scanfile("/" + filename);
+                scanfile(dfd, filename, "/" + filename, pfd);
             else
-                scanfile(path + "/" + filename);
+                scanfile(dfd, filename, path + "/" + filename, pfd);
         }
 
         filter_rules.restore();
+
+        /* Closes the underlying directory file descriptor as well. */
+        closedir(dir);
     }
 }
 
@@ -652,10 +1250,41 @@ void usage(const char *program)
         "                           (defaults to \".bz2\")\n"
         "  --signature-filter=COMMAND\n"
         "                       program though which to filter descriptor\n"
+        "  --group-filter=GROUP:EXT:COMMAND\n"
+        "                       filter segments of object group GROUP (e.g.\n"
+        "                           \"metadata\") through COMMAND instead of the\n"
+        "                           default filter, appending EXT to their\n"
+        "                           filenames; useful for dictionary-trained\n"
+        "                           compressors on repetitive groups\n"
         "  --scheme=NAME        optional name for this snapshot\n"
         "  --intent=FLOAT       DEPRECATED: ignored, and will be removed soon\n"
         "  --full-metadata      do not re-use metadata from previous backups\n"
         "  --rebuild-statcache  re-read all file data to verify statcache\n"
+        "  --threads=N          hash file data using N worker threads\n"
+        "                           (defaults to 1: synchronous operation)\n"
+        "  --transfer-threads=N perform up to N uploads concurrently\n"
+        "                           (defaults to 1: serial uploads)\n"
+        "  --chunker=NAME       sub-file chunking algorithm: fastcdc or lbfs\n"
+        "                           (defaults to \"fastcdc\")\n"
+        "  --segment-size=SIZE  maximum segment size, in bytes (suffixes K, M,\n"
+        "                           and G are accepted; defaults to 4M)\n"
+        "  --changed-paths=FILE skip directory subtrees containing none of the\n"
+        "                           paths listed (one per line) in FILE; the list\n"
+        "                           must cover created, modified and deleted paths\n"
+        "  --prefetch-depth=N   open up to N upcoming small files and start\n"
+        "                           readahead on them ahead of the backup loop\n"
+        "                           (defaults to 64; 0 disables prefetching)\n"
+        "  --checkpoint-interval=N\n"
+        "                       checkpoint the backup every N seconds, so an\n"
+        "                           interrupted run can be resumed without\n"
+        "                           redoing completed work (defaults to 0: no\n"
+        "                           checkpointing)\n"
+        "  --scan-order=ORDER   order in which each directory's entries are\n"
+        "                           dumped: \"name\" (the default) or \"inode\",\n"
+        "                           which approximates on-disk layout and cuts\n"
+        "                           seeks on rotating storage\n"
+        "  --metrics=PATH       write a JSON performance report to PATH at exit\n"
+        "  --metrics-interval=N also append a metrics snapshot every N seconds\n"
         "  -v --verbose         list files as they are backed up\n"
         "\n"
         "Exactly one of --dest or --upload-script must be specified.\n",
@@ -671,6 +1300,8 @@ int main(int argc, char *argv[])
     string localdb_dir = "";
     string backup_scheme = "";
     string signature_filter = "";
+    string metrics_path = "";
+    int metrics_interval = 0;
 
     string tmp_dir = "/tmp";
     if (getenv("TMPDIR") != NULL)
@@ -692,6 +1323,17 @@ int main(int argc, char *argv[])
             {"include", 1, 0, 0},           // 11
             {"exclude", 1, 0, 0},           // 12
             {"dir-merge", 1, 0, 0},         // 13
+            {"threads", 1, 0, 0},           // 14
+            {"transfer-threads", 1, 0, 0},  // 15
+            {"chunker", 1, 0, 0},           // 16
+            {"segment-size", 1, 0, 0},      // 17
+            {"metrics", 1, 0, 0},           // 18
+            {"metrics-interval", 1, 0, 0},  // 19
+            {"changed-paths", 1, 0, 0},     // 20
+            {"prefetch-depth", 1, 0, 0},    // 21
+            {"checkpoint-interval", 1, 0, 0},   // 22
+            {"scan-order", 1, 0, 0},        // 23
+            {"group-filter", 1, 0, 0},      // 24
             // Aliases for short options
             {"verbose", 0, 0, 'v'},
             {NULL, 0, 0, 0},
@@ -749,6 +1391,120 @@ int main(int argc, char *argv[])
             case 13:    // --dir-merge
                 filter_rules.add_pattern(PathFilterList::DIRMERGE, optarg, "");
                 break;
+            case 14:    // --threads
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    fprintf(stderr, "Error: Invalid thread count: %s\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 15:    // --transfer-threads
+                num_transfer_threads = atoi(optarg);
+                if (num_transfer_threads < 1) {
+                    fprintf(stderr, "Error: Invalid thread count: %s\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 16:    // --chunker
+                if (!chunk_select_algorithm(optarg)) {
+                    fprintf(stderr, "Error: Unknown chunker: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 17: {  // --segment-size
+                char *suffix = NULL;
+                long long size = strtoll(optarg, &suffix, 0);
+                switch (*suffix) {
+                case 'k': case 'K': size <<= 10; suffix++; break;
+                case 'm': case 'M': size <<= 20; suffix++; break;
+                case 'g': case 'G': size <<= 30; suffix++; break;
+                }
+                if (*suffix != '\0' || size < 1 << 20) {
+                    fprintf(stderr, "Error: Invalid segment size: %s\n",
+                            optarg);
+                    return 1;
+                }
+                segment_size_limit = size;
+                break;
+            }
+            case 18:    // --metrics
+                metrics_path = optarg;
+                break;
+            case 19:    // --metrics-interval
+                metrics_interval = atoi(optarg);
+                if (metrics_interval < 1) {
+                    fprintf(stderr, "Error: Invalid metrics interval: %s\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 20: {  // --changed-paths
+                std::ifstream change_list(optarg);
+                if (!change_list) {
+                    fprintf(stderr, "Error: Cannot open change list %s\n",
+                            optarg);
+                    return 1;
+                }
+                string line;
+                while (getline(change_list, line)) {
+                    while (!line.empty()
+                           && (line[line.size() - 1] == '\n'
+                               || line[line.size() - 1] == '\r'
+                               || line[line.size() - 1] == '/'))
+                        line.erase(line.size() - 1);
+                    if (line.empty())
+                        continue;
+                    changed_paths.insert(metafile_path(line));
+                }
+                flag_changed_paths = true;
+                break;
+            }
+            case 21:    // --prefetch-depth
+                prefetch_depth = atoi(optarg);
+                if (prefetch_depth < 0) {
+                    fprintf(stderr, "Error: Invalid prefetch depth: %s\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 22:    // --checkpoint-interval
+                checkpoint_interval = atoi(optarg);
+                if (checkpoint_interval < 0) {
+                    fprintf(stderr, "Error: Invalid checkpoint interval: %s\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 23:    // --scan-order
+                if (strcmp(optarg, "name") == 0) {
+                    flag_inode_order = false;
+                } else if (strcmp(optarg, "inode") == 0) {
+                    flag_inode_order = true;
+                } else {
+                    fprintf(stderr, "Error: Invalid scan order: %s\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 24: {  // --group-filter=GROUP:EXT:COMMAND
+                string arg = optarg;
+                size_t c1 = arg.find(':');
+                size_t c2 = (c1 == string::npos)
+                    ? string::npos : arg.find(':', c1 + 1);
+                if (c1 == string::npos || c2 == string::npos
+                    || c1 == 0 || c2 == arg.size() - 1) {
+                    fprintf(stderr,
+                            "Error: Invalid group filter (expected "
+                            "GROUP:EXT:COMMAND): %s\n", optarg);
+                    return 1;
+                }
+                set_group_filter(arg.substr(0, c1),
+                                 arg.substr(c2 + 1),
+                                 arg.substr(c1 + 1, c2 - c1 - 1));
+                break;
+            }
             default:
                 fprintf(stderr, "Unhandled long option!\n");
                 return 1;
@@ -797,6 +1553,11 @@ int main(int argc, char *argv[])
 
     block_buf = new char[LBS_BLOCK_SIZE];
 
+    /* When multiple threads were requested, build the parallel pipeline used
+     * by dumpfile to overlap reading and hashing of file data. */
+    if (num_threads > 1)
+        pipeline = new BlockPipeline(num_threads);
+
     /* Initialize the remote storage layer.  If using an upload script, create
      * a temporary directory for staging files.  Otherwise, write backups
      * directly to the destination directory. */
@@ -807,9 +1568,9 @@ int main(int argc, char *argv[])
                     tmp_dir.c_str());
             return 1;
         }
-        remote = new RemoteStore(tmp_dir, backup_script=backup_script);
+        remote = new RemoteStore(tmp_dir, backup_script, num_transfer_threads);
     } else {
-        remote = new RemoteStore(backup_dest);
+        remote = new RemoteStore(backup_dest, "", num_transfer_threads);
     }
 
     /* Store the time when the backup started, so it can be included in the
@@ -829,11 +1590,20 @@ int main(int argc, char *argv[])
     tss = new TarSegmentStore(remote, db);
 
     /* Initialize the stat cache, for skipping over unchanged files. */
-    metawriter = new MetadataWriter(tss, localdb_dir.c_str(), timestamp.c_str(),
+    metawriter = new MetadataWriter(tss, localdb_dir.c_str(),
                                     backup_scheme.c_str());
+    last_checkpoint = time(NULL);
+
+    if (metrics_path.size() > 0)
+        metrics_init(metrics_path.c_str(), metrics_interval);
 
     for (int i = optind; i < argc; i++) {
-        scanfile(argv[i]);
+        scanfile(AT_FDCWD, argv[i], argv[i]);
+    }
+
+    if (pipeline != NULL) {
+        delete pipeline;
+        pipeline = NULL;
     }
 
     ObjectReference root_ref = metawriter->close();
@@ -939,6 +1709,8 @@ int main(int argc, char *argv[])
     remote->sync();
     delete remote;
 
+    metrics_shutdown();
+
     if (backup_script != "") {
         if (rmdir(tmp_dir.c_str()) < 0) {
             fprintf(stderr,
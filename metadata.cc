@@ -23,8 +23,12 @@
  * handling of the statcache, and re-use of metadata between snapshots.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <map>
@@ -43,6 +47,26 @@ using std::ostringstream;
 
 static const size_t LBS_METADATA_BLOCK_SIZE = 65536;
 
+/* The statcache is stored in a binary, indexed format (the "statcache3"
+ * file).  The file starts with a magic string, followed by a sequence of
+ * records, one per file backed up.  Each record is three 32-bit lengths
+ * (path, metadata location, metadata text) followed by the three byte
+ * strings.  At the end of the file is an index--a count and then (path hash,
+ * record offset) pairs sorted by hash--and finally a 16-byte trailer giving
+ * the offset of the index and a second magic string.  All integers are in
+ * host byte order; the statcache is a local cache file and is never
+ * transferred between machines.
+ *
+ * The old line-oriented text format ("statcache2") can still be read; it is
+ * indexed with a one-time sequential scan the first time a backup runs after
+ * an upgrade. */
+static const char STATCACHE3_MAGIC[] = "Cumulus statcache v3\n";
+static const char STATCACHE3_TRAILER_MAGIC[8] = {'L','B','S','I','D','X','3','\n'};
+
+/* Limit on the size of any single field in a statcache record, as a guard
+ * against reading a corrupted file. */
+static const uint32_t STATCACHE3_MAX_FIELD = 1 << 30;
+
 // If true, forces a full write of metadata: will not include pointers to
 // metadata in old snapshots.
 bool flag_full_metadata = false;
@@ -50,48 +74,10 @@ bool flag_full_metadata = false;
 /* TODO: Move to header file */
 extern LocalDb *db;
 
-/* Like strcmp, but sorts in the order that files will be visited in the
- * filesystem.  That is, we break paths apart at slashes, and compare path
- * components separately. */
-static int pathcmp(const char *path1, const char *path2)
-{
-    /* Find the first component in each path. */
-    const char *slash1 = strchr(path1, '/');
-    const char *slash2 = strchr(path2, '/');
-
-    {
-        string comp1, comp2;
-        if (slash1 == NULL)
-            comp1 = path1;
-        else
-            comp1 = string(path1, slash1 - path1);
-
-        if (slash2 == NULL)
-            comp2 = path2;
-        else
-            comp2 = string(path2, slash2 - path2);
-
-        /* Directly compare the two components first. */
-        if (comp1 < comp2)
-            return -1;
-        if (comp1 > comp2)
-            return 1;
-    }
-
-    if (slash1 == NULL && slash2 == NULL)
-        return 0;
-    if (slash1 == NULL)
-        return -1;
-    if (slash2 == NULL)
-        return 1;
-
-    return pathcmp(slash1 + 1, slash2 + 1);
-}
-
 /* Encode a dictionary of string key/value pairs into a sequence of lines of
  * the form "key: value".  If it exists, the key "name" is treated specially
  * and will be listed first. */
-static string encode_dict(const map<string, string>& dict)
+static string encode_dict(const dictionary& dict)
 {
     string result;
 
@@ -99,7 +85,7 @@ static string encode_dict(const map<string, string>& dict)
         result += "name: " + dict.find("name")->second + "\n";
     }
 
-    for (map<string, string>::const_iterator i = dict.begin();
+    for (dictionary::const_iterator i = dict.begin();
          i != dict.end(); ++i) {
         if (i->first == "name")
             continue;
@@ -111,16 +97,53 @@ static string encode_dict(const map<string, string>& dict)
 
 MetadataWriter::MetadataWriter(TarSegmentStore *store,
                                const char *path,
-                               const char *snapshot_name,
                                const char *snapshot_scheme)
 {
-    statcache_path = path;
-    statcache_path += "/statcache2";
+    string scheme_suffix = "";
     if (snapshot_scheme != NULL && strlen(snapshot_scheme) > 0)
-        statcache_path = statcache_path + "-" + snapshot_scheme;
-    statcache_tmp_path = statcache_path + "." + snapshot_name;
+        scheme_suffix = string("-") + snapshot_scheme;
+
+    statcache_path = string(path) + "/statcache3" + scheme_suffix;
+    statcache_tmp_path = statcache_path + ".partial";
+    statcache_resume_path = statcache_path + ".resume";
+
+    old_metadata_eof = false;
+    statcache_legacy = false;
+    old_records_end = 0;
+    statcache_resume = NULL;
 
     statcache_in = fopen(statcache_path.c_str(), "r");
+    if (statcache_in != NULL && !load_index()) {
+        fprintf(stderr, "Warning: Cannot read statcache index from %s; "
+                "ignoring it\n", statcache_path.c_str());
+        fclose(statcache_in);
+        statcache_in = NULL;
+    }
+
+    /* If there is no statcache in the current format, fall back to a
+     * statcache left behind by an older version of cumulus; it is indexed
+     * with a single sequential scan. */
+    if (statcache_in == NULL) {
+        string legacy_path = string(path) + "/statcache2" + scheme_suffix;
+        statcache_in = fopen(legacy_path.c_str(), "r");
+        if (statcache_in != NULL) {
+            statcache_legacy = true;
+            build_legacy_index();
+        }
+    }
+
+    /* A leftover partial statcache means the previous backup was
+     * interrupted.  Move it aside (the name is about to be reused for this
+     * run's output) and index its records, so files already processed by the
+     * interrupted run can be skipped.  Every entry consulted from it is
+     * still validated against the local database before being reused. */
+    if (access(statcache_tmp_path.c_str(), R_OK) == 0)
+        rename(statcache_tmp_path.c_str(), statcache_resume_path.c_str());
+    statcache_resume = fopen(statcache_resume_path.c_str(), "r");
+    if (statcache_resume != NULL && !build_resume_index()) {
+        fclose(statcache_resume);
+        statcache_resume = NULL;
+    }
 
     statcache_out = fopen(statcache_tmp_path.c_str(), "w");
     if (statcache_out == NULL) {
@@ -128,13 +151,136 @@ MetadataWriter::MetadataWriter(TarSegmentStore *store,
                 statcache_tmp_path.c_str());
         fatal("Error opening statcache");
     }
-
-    old_metadata_eof = false;
+    fwrite(STATCACHE3_MAGIC, 1, strlen(STATCACHE3_MAGIC), statcache_out);
 
     this->store = store;
     chunk_size = 0;
 }
 
+/* Hash a path for the statcache index (64-bit FNV-1a).  Colliding paths are
+ * disambiguated by comparing the path stored in each candidate record. */
+uint64_t MetadataWriter::hash_path(const string &path)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < path.size(); i++) {
+        h ^= (uint8_t)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Read the index from a statcache3 file into old_index.  Returns false if the
+ * file does not appear to be a valid statcache. */
+bool MetadataWriter::load_index()
+{
+    char magic[sizeof(STATCACHE3_MAGIC)];
+    size_t magic_len = strlen(STATCACHE3_MAGIC);
+
+    if (fread(magic, 1, magic_len, statcache_in) != magic_len
+        || memcmp(magic, STATCACHE3_MAGIC, magic_len) != 0)
+        return false;
+
+    if (fseeko(statcache_in, -16, SEEK_END) < 0)
+        return false;
+    off_t file_size = ftello(statcache_in) + 16;
+
+    uint64_t index_offset;
+    char trailer_magic[8];
+    if (fread(&index_offset, sizeof(index_offset), 1, statcache_in) != 1
+        || fread(trailer_magic, 1, 8, statcache_in) != 8
+        || memcmp(trailer_magic, STATCACHE3_TRAILER_MAGIC, 8) != 0
+        || index_offset >= (uint64_t)file_size)
+        return false;
+
+    if (fseeko(statcache_in, index_offset, SEEK_SET) < 0)
+        return false;
+
+    uint64_t count;
+    if (fread(&count, sizeof(count), 1, statcache_in) != 1)
+        return false;
+    if (count > ((uint64_t)file_size - index_offset) / 16)
+        return false;
+
+    old_index.resize(count);
+    if (count > 0
+        && fread(&old_index[0], 16, count, statcache_in) != count) {
+        old_index.clear();
+        return false;
+    }
+
+    /* The index is written sorted, but sort again in case the file was
+     * produced by something else. */
+    std::sort(old_index.begin(), old_index.end());
+    old_records_end = index_offset;
+    return true;
+}
+
+/* Index a legacy text-format statcache by scanning it once, recording the
+ * offset of every entry. */
+void MetadataWriter::build_legacy_index()
+{
+    while (true) {
+        uint64_t offset = ftello(statcache_in);
+        read_statcache();
+        if (old_metadata_eof)
+            break;
+        old_index.push_back(std::make_pair(
+            hash_path(uri_decode(old_metadata["name"])), offset));
+    }
+
+    std::sort(old_index.begin(), old_index.end());
+    old_metadata.clear();
+    old_metadata_eof = false;
+}
+
+/* Index the partial statcache from an interrupted backup.  The file was cut
+ * off before the index and trailer were appended, so scan the records
+ * sequentially, stopping at the first one that is truncated or implausible.
+ * Returns false if the file yields no usable records. */
+bool MetadataWriter::build_resume_index()
+{
+    char magic[sizeof(STATCACHE3_MAGIC)];
+    size_t magic_len = strlen(STATCACHE3_MAGIC);
+
+    if (fread(magic, 1, magic_len, statcache_resume) != magic_len
+        || memcmp(magic, STATCACHE3_MAGIC, magic_len) != 0)
+        return false;
+
+    if (fseeko(statcache_resume, 0, SEEK_END) < 0)
+        return false;
+    off_t file_size = ftello(statcache_resume);
+    if (fseeko(statcache_resume, magic_len, SEEK_SET) < 0)
+        return false;
+
+    while (true) {
+        uint64_t offset = ftello(statcache_resume);
+
+        uint32_t lengths[3];
+        if (fread(lengths, sizeof(uint32_t), 3, statcache_resume) != 3)
+            break;
+        if (lengths[0] > STATCACHE3_MAX_FIELD
+            || lengths[1] > STATCACHE3_MAX_FIELD
+            || lengths[2] > STATCACHE3_MAX_FIELD)
+            break;
+        uint64_t total = (uint64_t)lengths[0] + lengths[1] + lengths[2];
+        if (offset + 3 * sizeof(uint32_t) + total > (uint64_t)file_size)
+            break;
+
+        string entry_path(lengths[0], '\0');
+        if (lengths[0] > 0
+            && fread(&entry_path[0], 1, lengths[0],
+                     statcache_resume) != lengths[0])
+            break;
+        if (fseeko(statcache_resume, lengths[1] + lengths[2], SEEK_CUR) < 0)
+            break;
+
+        resume_index.push_back(std::make_pair(hash_path(entry_path), offset));
+    }
+
+    std::sort(resume_index.begin(), resume_index.end());
+    return !resume_index.empty();
+}
+
 /* Read the next entry from the old statcache file, loading it into
  * old_metadata. */
 void MetadataWriter::read_statcache()
@@ -203,20 +349,144 @@ void MetadataWriter::read_statcache()
     free(buf);
 }
 
+/* Parse metadata text (a block of "key: value" lines, with continuation lines
+ * starting with whitespace) into a dictionary.  This is the same format
+ * produced by encode_dict and stored in both the metadata log and the
+ * statcache. */
+static void parse_metadata_text(const string &text, dictionary *dict)
+{
+    string field = "";
+    size_t pos = 0;
+
+    dict->clear();
+
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        if (eol == string::npos)
+            eol = text.size();
+        string line = text.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        if (line.empty())
+            continue;
+
+        if (isspace(line[0]) && field != "") {
+            (*dict)[field] += string("\n") + line;
+            continue;
+        }
+
+        size_t colon = line.find(':');
+        if (colon == string::npos)
+            continue;
+        field = line.substr(0, colon);
+
+        size_t value = colon + 1;
+        while (value < line.size() && isspace(line[value]))
+            value++;
+
+        (*dict)[field] = line.substr(value);
+    }
+}
+
+/* Load the binary-format statcache entry at the given offset of a file, if it
+ * is for the given path.  Returns true and fills in
+ * old_metadata/old_metadata_loc on a match. */
+bool MetadataWriter::read_binary_entry(FILE *fp, uint64_t offset,
+                                       const string &path)
+{
+    if (fseeko(fp, offset, SEEK_SET) < 0)
+        return false;
+
+    uint32_t lengths[3];
+    if (fread(lengths, sizeof(uint32_t), 3, fp) != 3)
+        return false;
+    if (lengths[0] > STATCACHE3_MAX_FIELD || lengths[1] > STATCACHE3_MAX_FIELD
+        || lengths[2] > STATCACHE3_MAX_FIELD)
+        return false;
+
+    string entry_path(lengths[0], '\0');
+    if (lengths[0] > 0
+        && fread(&entry_path[0], 1, lengths[0], fp) != lengths[0])
+        return false;
+    if (entry_path != path)
+        return false;
+
+    string loc(lengths[1], '\0');
+    string text(lengths[2], '\0');
+    if (lengths[1] > 0
+        && fread(&loc[0], 1, lengths[1], fp) != lengths[1])
+        return false;
+    if (lengths[2] > 0
+        && fread(&text[0], 1, lengths[2], fp) != lengths[2])
+        return false;
+
+    old_metadata_loc = loc;
+    parse_metadata_text(text, &old_metadata);
+    return true;
+}
+
+/* Load the statcache entry at the given offset, if it is for the given path.
+ * Returns true and fills in old_metadata/old_metadata_loc on a match. */
+bool MetadataWriter::read_entry(uint64_t offset, const string &path)
+{
+    if (statcache_legacy) {
+        if (fseeko(statcache_in, offset, SEEK_SET) < 0)
+            return false;
+        read_statcache();
+        if (old_metadata_eof) {
+            old_metadata_eof = false;
+            return false;
+        }
+        return uri_decode(old_metadata["name"]) == path;
+    }
+
+    return read_binary_entry(statcache_in, offset, path);
+}
+
+/* Look up a path in the old statcache.  The index makes this a direct lookup,
+ * so cache hits do not depend on the filesystem being traversed in the same
+ * order as the previous backup. */
 bool MetadataWriter::find(const string& path)
 {
-    const char *path_str = path.c_str();
-    while (!old_metadata_eof) {
-        string old_path = uri_decode(old_metadata["name"]);
-        int cmp = pathcmp(old_path.c_str(), path_str);
-        if (cmp == 0)
+    old_metadata.clear();
+    old_metadata_loc = "";
+
+    uint64_t h = hash_path(path);
+
+    /* Check the statcache of an interrupted backup first: its entries are
+     * newer than anything in the last complete statcache. */
+    if (statcache_resume != NULL) {
+        statcache_index::const_iterator i
+            = std::lower_bound(resume_index.begin(), resume_index.end(),
+                               std::make_pair(h, (uint64_t)0));
+        for (; i != resume_index.end() && i->first == h; ++i) {
+            if (read_binary_entry(statcache_resume, i->second, path))
+                return true;
+        }
+        old_metadata.clear();
+    }
+
+    return find_in_old(path);
+}
+
+/* As find(), but consults only the last complete statcache, never the
+ * interrupted-backup one.  reuse_subtree() depends on the lookup leaving
+ * statcache_in positioned just past the matched record. */
+bool MetadataWriter::find_in_old(const string& path)
+{
+    if (statcache_in == NULL)
+        return false;
+
+    uint64_t h = hash_path(path);
+    statcache_index::const_iterator i
+        = std::lower_bound(old_index.begin(), old_index.end(),
+                           std::make_pair(h, (uint64_t)0));
+    for (; i != old_index.end() && i->first == h; ++i) {
+        if (read_entry(i->second, path))
             return true;
-        else if (cmp > 0)
-            return false;
-        else
-            read_statcache();
     }
 
+    old_metadata.clear();
     return false;
 }
 
@@ -254,12 +524,11 @@ bool MetadataWriter::is_unchanged(const struct stat *stat_buf)
     return true;
 }
 
-list<ObjectReference> MetadataWriter::get_blocks()
+/* Parse a whitespace-separated list of object references (the "data" field of
+ * a metadata entry). */
+static void parse_block_list(const string &data, list<ObjectReference> *blocks)
 {
-    list<ObjectReference> blocks;
-
-    /* Parse the list of blocks. */
-    const char *s = old_metadata["data"].c_str();
+    const char *s = data.c_str();
     while (*s != '\0') {
         if (isspace(*s)) {
             s++;
@@ -277,12 +546,108 @@ list<ObjectReference> MetadataWriter::get_blocks()
 
         ObjectReference r = ObjectReference::parse(ref);
         if (!r.is_null())
-            blocks.push_back(r);
+            blocks->push_back(r);
     }
+}
 
+list<ObjectReference> MetadataWriter::get_blocks()
+{
+    list<ObjectReference> blocks;
+    parse_block_list(old_metadata["data"], &blocks);
     return blocks;
 }
 
+/* Re-emit all entries from the previous backup lying below the given
+ * directory.  The statcache records descendants of a directory contiguously
+ * after the directory itself (records are written in traversal order), so
+ * the whole subtree can be copied with one sequential read.  The entries are
+ * collected and validated first, so either the complete subtree is emitted or
+ * nothing is. */
+bool MetadataWriter::reuse_subtree(const string& path)
+{
+    if (statcache_in == NULL || statcache_legacy || flag_full_metadata)
+        return false;
+
+    /* Position the statcache just past the directory's own record. */
+    if (!find_in_old(path))
+        return false;
+
+    string prefix = (path == ".") ? "" : path + "/";
+
+    list<MetadataItem> reused;
+    list<ObjectReference> blocks;
+
+    while ((uint64_t)ftello(statcache_in) < old_records_end) {
+        uint32_t lengths[3];
+        if (fread(lengths, sizeof(uint32_t), 3, statcache_in) != 3)
+            return false;
+        if (lengths[0] > STATCACHE3_MAX_FIELD
+            || lengths[1] > STATCACHE3_MAX_FIELD
+            || lengths[2] > STATCACHE3_MAX_FIELD)
+            return false;
+
+        string entry_path(lengths[0], '\0');
+        if (lengths[0] > 0
+            && fread(&entry_path[0], 1, lengths[0],
+                     statcache_in) != lengths[0])
+            return false;
+
+        /* First entry outside the subtree: done. */
+        if (entry_path.compare(0, prefix.size(), prefix) != 0)
+            break;
+
+        string loc(lengths[1], '\0');
+        string text(lengths[2], '\0');
+        if (lengths[1] > 0
+            && fread(&loc[0], 1, lengths[1], statcache_in) != lengths[1])
+            return false;
+        if (lengths[2] > 0
+            && fread(&text[0], 1, lengths[2], statcache_in) != lengths[2])
+            return false;
+
+        /* The metadata itself and every data block it references must still
+         * be available; if any object has been expired the subtree has to be
+         * re-scanned so the data is re-stored. */
+        MetadataItem item;
+        item.offset = 0;
+        item.path = entry_path;
+        item.text = text;
+        item.ref = ObjectReference::parse(loc);
+        item.reused = !item.ref.is_null() && db->IsAvailable(item.ref);
+        if (!item.reused)
+            return false;
+
+        dictionary info;
+        parse_metadata_text(text, &info);
+        list<ObjectReference> entry_blocks;
+        parse_block_list(info["data"], &entry_blocks);
+        for (list<ObjectReference>::const_iterator i = entry_blocks.begin();
+             i != entry_blocks.end(); ++i) {
+            if (!db->IsAvailable(*i))
+                return false;
+        }
+        blocks.splice(blocks.end(), entry_blocks);
+
+        reused.push_back(item);
+    }
+
+    /* Everything checks out: record the data blocks as used and queue the
+     * entries for the metadata log, exactly as add() would. */
+    for (list<ObjectReference>::const_iterator i = blocks.begin();
+         i != blocks.end(); ++i)
+        db->UseObject(*i);
+
+    for (list<MetadataItem>::iterator i = reused.begin();
+         i != reused.end(); ++i) {
+        chunk_size += i->text.size();
+        items.push_back(*i);
+        if (chunk_size > LBS_METADATA_BLOCK_SIZE)
+            metadata_flush();
+    }
+
+    return true;
+}
+
 /* Ensure contents of metadata are flushed to an object. */
 void MetadataWriter::metadata_flush()
 {
@@ -346,8 +711,10 @@ void MetadataWriter::metadata_flush()
 
     delete meta;
 
-    /* Write these files out to the statcache, and include a reference to where
-     * the metadata lives (so we can re-use it if it has not changed). */
+    /* Write these files out to the statcache, and include a reference to
+     * where the metadata lives (so we can re-use it if it has not changed).
+     * Each record is indexed by a hash of the path for random-access lookup
+     * during the next backup. */
     for (list<MetadataItem>::const_iterator i = items.begin();
          i != items.end(); ++i) {
         ObjectReference r = ref;
@@ -357,7 +724,18 @@ void MetadataWriter::metadata_flush()
             r = i->ref;
 
         string refstr = r.to_string();
-        fprintf(statcache_out, "@@%s\n%s", refstr.c_str(), i->text.c_str());
+
+        new_index.push_back(std::make_pair(hash_path(i->path),
+                                           (uint64_t)ftello(statcache_out)));
+
+        uint32_t lengths[3];
+        lengths[0] = i->path.size();
+        lengths[1] = refstr.size();
+        lengths[2] = i->text.size();
+        fwrite(lengths, sizeof(uint32_t), 3, statcache_out);
+        fwrite(i->path.data(), 1, i->path.size(), statcache_out);
+        fwrite(refstr.data(), 1, refstr.size(), statcache_out);
+        fwrite(i->text.data(), 1, i->text.size(), statcache_out);
     }
 
     chunk_size = 0;
@@ -368,6 +746,7 @@ void MetadataWriter::add(dictionary info)
 {
     MetadataItem item;
     item.offset = 0;
+    item.path = uri_decode(info["name"]);
     item.reused = false;
     item.text += encode_dict(info) + "\n";
 
@@ -386,6 +765,17 @@ void MetadataWriter::add(dictionary info)
         metadata_flush();
 }
 
+/* Checkpoint the metadata state of an in-progress backup: write out any
+ * buffered metadata entries and flush the statcache records accumulated so
+ * far.  If the backup is interrupted later, the statcache written up to this
+ * point lets the next run skip the files already processed.  The caller is
+ * responsible for also flushing the segment store and the local database. */
+void MetadataWriter::checkpoint()
+{
+    metadata_flush();
+    fflush(statcache_out);
+}
+
 ObjectReference MetadataWriter::close()
 {
     metadata_flush();
@@ -400,11 +790,29 @@ ObjectReference MetadataWriter::close()
     ObjectReference ref = root->get_ref();
     delete root;
 
+    /* Append the statcache index and trailer. */
+    std::sort(new_index.begin(), new_index.end());
+    uint64_t index_offset = ftello(statcache_out);
+    uint64_t count = new_index.size();
+    fwrite(&count, sizeof(count), 1, statcache_out);
+    if (count > 0)
+        fwrite(&new_index[0], 16, count, statcache_out);
+    fwrite(&index_offset, sizeof(index_offset), 1, statcache_out);
+    fwrite(STATCACHE3_TRAILER_MAGIC, 1, 8, statcache_out);
+
     fclose(statcache_out);
     if (rename(statcache_tmp_path.c_str(), statcache_path.c_str()) < 0) {
         fprintf(stderr, "Error renaming statcache from %s to %s: %m\n",
                 statcache_tmp_path.c_str(), statcache_path.c_str());
     }
 
+    /* The backup completed, so any interrupted-backup statcache is now fully
+     * superseded by the file just written. */
+    if (statcache_resume != NULL) {
+        fclose(statcache_resume);
+        statcache_resume = NULL;
+        unlink(statcache_resume_path.c_str());
+    }
+
     return ref;
 }
@@ -26,12 +26,15 @@
 #ifndef _LBS_METADATA_H
 #define _LBS_METADATA_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <list>
 #include <string>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 #include "store.h"
 #include "ref.h"
@@ -42,6 +45,7 @@ extern bool flag_full_metadata;
 /* Metadata for a single inode, ready to be written out. */
 struct MetadataItem {
     int offset;
+    std::string path;           // Decoded path, for the statcache index
     std::string text;
 
     bool reused;
@@ -51,15 +55,30 @@ struct MetadataItem {
 class MetadataWriter {
 public:
     MetadataWriter(TarSegmentStore *store, const char *path,
-                   const char *snapshot_name, const char *snapshot_scheme);
+                   const char *snapshot_scheme);
     void add(dictionary info);
     ObjectReference close();
 
+    /* Flush buffered metadata to the segment store and push the statcache
+     * records written so far out to the filesystem.  Called when
+     * checkpointing an in-progress backup: together with committing the
+     * local database and uploading closed segments, this lets a restarted
+     * backup resume from near the point of interruption. */
+    void checkpoint();
+
     bool find(const std::string& path);
     ObjectReference old_ref() const {
         return ObjectReference::parse(old_metadata_loc);
     }
 
+    /* Re-emit every entry below the given directory from the previous
+     * backup's statcache, without visiting the filesystem.  Used when an
+     * external change journal says the subtree is unchanged.  Returns false
+     * (emitting nothing) if the old entries cannot be reused--no statcache,
+     * legacy statcache format, --full-metadata, or an expired object--in
+     * which case the caller must walk the subtree normally. */
+    bool reuse_subtree(const std::string& path);
+
     bool is_unchanged(const struct stat *stat_buf);
 
     dictionary get_old_metadata() const { return old_metadata; }
@@ -67,9 +86,24 @@ public:
     std::string get_checksum() { return old_metadata["checksum"]; }
 
 private:
+    // The statcache index: a list of (path hash, file offset) pairs, sorted
+    // by hash, locating each entry in the statcache file.  Lookups by find()
+    // are a binary search here followed by a single seek, so cache hits do
+    // not depend on the order in which the filesystem is traversed.
+    typedef std::vector<std::pair<uint64_t, uint64_t> > statcache_index;
+
     void metadata_flush();
     void read_statcache();
 
+    static uint64_t hash_path(const std::string &path);
+    bool load_index();
+    void build_legacy_index();
+    bool build_resume_index();
+    bool find_in_old(const std::string& path);
+    bool read_entry(uint64_t offset, const std::string &path);
+    bool read_binary_entry(FILE *fp, uint64_t offset,
+                           const std::string &path);
+
     // Where are objects eventually written to?
     TarSegmentStore *store;
 
@@ -77,6 +111,15 @@ private:
     std::string statcache_path, statcache_tmp_path;
     FILE *statcache_in, *statcache_out;
 
+    /* Statcache left behind by an interrupted backup.  Its records cover the
+     * files processed before the interruption; they are consulted (ahead of
+     * the last complete statcache) so a resumed backup can skip re-reading
+     * those files.  The file lacks an index, so one is rebuilt by a
+     * sequential scan. */
+    std::string statcache_resume_path;
+    FILE *statcache_resume;
+    statcache_index resume_index;
+
     // Metadata not yet written out to the segment store
     size_t chunk_size;
     std::list<MetadataItem> items;
@@ -84,6 +127,10 @@ private:
 
     // Statcache information read back in from a previous run
     bool old_metadata_eof;
+    bool statcache_legacy;          // Old statcache is the v2 text format
+    uint64_t old_records_end;       // File offset where v3 records stop
+    statcache_index old_index;      // Index of the old statcache file
+    statcache_index new_index;      // Index of entries written so far
     dictionary old_metadata;
     std::string old_metadata_loc;   // Reference to where the metadata is found
 };
@@ -0,0 +1,196 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Implementation of the per-phase performance counters.  Each thread that
+ * records a metric gets its own block of counters, linked into a global list
+ * the first time the thread reports anything; the reporting side sums over
+ * all blocks.  Readers take no locks and may observe counters mid-update,
+ * which is acceptable for statistics output. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "util.h"
+
+bool metrics_enabled = false;
+
+/* Counters for one phase within one thread.  Only the owning thread writes
+ * to these, so no atomic operations are needed. */
+struct PhaseCounters {
+    int64_t calls;
+    int64_t ns;
+    int64_t bytes;
+};
+
+struct ThreadCounters {
+    PhaseCounters phases[METRICS_PHASE_MAX];
+    ThreadCounters *next;
+};
+
+static const char *phase_names[METRICS_PHASE_MAX] = {
+    "traverse", "stat", "read", "hash", "chunk", "compress", "db",
+    "upload_wait",
+};
+
+/* List of all threads' counter blocks; protected by list_lock.  Blocks are
+ * never freed, so the report thread can walk the list safely. */
+static ThreadCounters *all_threads = NULL;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ThreadCounters *my_counters = NULL;
+
+static FILE *report_file = NULL;
+static int64_t start_time = 0;
+static pthread_t report_thread;
+static bool report_thread_running = false;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t report_cond = PTHREAD_COND_INITIALIZER;
+static bool report_terminate = false;
+
+int64_t metrics_clock()
+{
+    if (!metrics_enabled)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ThreadCounters *get_counters()
+{
+    if (my_counters == NULL) {
+        ThreadCounters *c = new ThreadCounters;
+        memset(c->phases, 0, sizeof(c->phases));
+        pthread_mutex_lock(&list_lock);
+        c->next = all_threads;
+        all_threads = c;
+        pthread_mutex_unlock(&list_lock);
+        my_counters = c;
+    }
+    return my_counters;
+}
+
+void metrics_add(MetricsPhase phase, int64_t ns)
+{
+    if (!metrics_enabled)
+        return;
+    PhaseCounters *c = &get_counters()->phases[phase];
+    c->calls++;
+    c->ns += ns;
+}
+
+void metrics_add_bytes(MetricsPhase phase, int64_t bytes)
+{
+    if (!metrics_enabled)
+        return;
+    get_counters()->phases[phase].bytes += bytes;
+}
+
+/* Write one snapshot of the counters as a single JSON line. */
+static void write_report()
+{
+    PhaseCounters totals[METRICS_PHASE_MAX];
+    memset(totals, 0, sizeof(totals));
+
+    pthread_mutex_lock(&list_lock);
+    for (ThreadCounters *t = all_threads; t != NULL; t = t->next) {
+        for (int i = 0; i < METRICS_PHASE_MAX; i++) {
+            totals[i].calls += t->phases[i].calls;
+            totals[i].ns += t->phases[i].ns;
+            totals[i].bytes += t->phases[i].bytes;
+        }
+    }
+    pthread_mutex_unlock(&list_lock);
+
+    fprintf(report_file, "{\"elapsed\": %.3f, \"phases\": {",
+            (metrics_clock() - start_time) / 1e9);
+    for (int i = 0; i < METRICS_PHASE_MAX; i++) {
+        fprintf(report_file,
+                "%s\"%s\": {\"calls\": %lld, \"seconds\": %.3f, "
+                "\"bytes\": %lld}",
+                (i == 0) ? "" : ", ", phase_names[i],
+                (long long)totals[i].calls, totals[i].ns / 1e9,
+                (long long)totals[i].bytes);
+    }
+    fprintf(report_file, "}}\n");
+    fflush(report_file);
+}
+
+static void *report_thread_func(void *arg)
+{
+    int interval = *(int *)arg;
+    delete (int *)arg;
+
+    pthread_mutex_lock(&report_lock);
+    while (!report_terminate) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += interval;
+        if (pthread_cond_timedwait(&report_cond, &report_lock, &ts) != 0
+            && !report_terminate) {
+            pthread_mutex_unlock(&report_lock);
+            write_report();
+            pthread_mutex_lock(&report_lock);
+        }
+    }
+    pthread_mutex_unlock(&report_lock);
+    return NULL;
+}
+
+void metrics_init(const char *path, int interval)
+{
+    report_file = fopen(path, "w");
+    if (report_file == NULL)
+        fatal(string_printf("Cannot open metrics file %s", path));
+
+    metrics_enabled = true;
+    start_time = metrics_clock();
+
+    if (interval > 0) {
+        int *arg = new int(interval);
+        if (pthread_create(&report_thread, NULL, report_thread_func,
+                           arg) != 0)
+            fatal("Cannot create metrics reporting thread");
+        report_thread_running = true;
+    }
+}
+
+void metrics_shutdown()
+{
+    if (!metrics_enabled)
+        return;
+
+    if (report_thread_running) {
+        pthread_mutex_lock(&report_lock);
+        report_terminate = true;
+        pthread_cond_broadcast(&report_cond);
+        pthread_mutex_unlock(&report_lock);
+        pthread_join(report_thread, NULL);
+        report_thread_running = false;
+    }
+
+    write_report();
+    fclose(report_file);
+    report_file = NULL;
+    metrics_enabled = false;
+}
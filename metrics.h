@@ -0,0 +1,79 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Lightweight per-phase performance instrumentation.  Each phase of the
+ * backup pipeline accumulates call counts, wall time, and byte counts into
+ * thread-local counters (so instrumented hot paths never contend on a lock);
+ * the totals are emitted as a single-line JSON report at exit, and
+ * optionally periodically during the backup.  All instrumentation is
+ * disabled (and nearly free) unless requested with --metrics. */
+
+#ifndef _LBS_METRICS_H
+#define _LBS_METRICS_H
+
+#include <stdint.h>
+
+/* The instrumented phases of the backup pipeline. */
+enum MetricsPhase {
+    METRICS_TRAVERSE,           // Directory scanning and filtering
+    METRICS_STAT,               // lstat calls during traversal
+    METRICS_READ,               // Reading file data from disk
+    METRICS_HASH,               // Block- and file-level checksumming
+    METRICS_CHUNK,              // Content-defined chunking (subfile analysis)
+    METRICS_COMPRESS,           // In-process segment compression
+    METRICS_DB,                 // Local database queries and writes
+    METRICS_UPLOAD_WAIT,        // Blocked waiting for segment write-out
+    METRICS_PHASE_MAX
+};
+
+/* True once metrics collection has been requested; checked by the timers so
+ * that instrumentation costs nothing when disabled. */
+extern bool metrics_enabled;
+
+/* Begin collecting metrics.  The report is written to the given path (the
+ * file is truncated first); if interval is nonzero a background thread
+ * appends a snapshot line every interval seconds. */
+void metrics_init(const char *path, int interval);
+
+/* Write the final report and stop the periodic reporting thread, if any.
+ * Harmless if metrics were never enabled. */
+void metrics_shutdown();
+
+/* Record ns nanoseconds (and one call) against a phase. */
+void metrics_add(MetricsPhase phase, int64_t ns);
+
+/* Record a number of bytes processed by a phase. */
+void metrics_add_bytes(MetricsPhase phase, int64_t bytes);
+
+/* Current monotonic time in nanoseconds, or 0 when metrics are disabled. */
+int64_t metrics_clock();
+
+/* RAII timer: charges the wall time for which it is in scope to one phase. */
+class MetricsTimer {
+public:
+    MetricsTimer(MetricsPhase phase)
+        : phase(phase), start(metrics_clock()) { }
+    ~MetricsTimer()
+        { if (metrics_enabled) metrics_add(phase, metrics_clock() - start); }
+private:
+    MetricsPhase phase;
+    int64_t start;
+};
+
+#endif // _LBS_METRICS_H
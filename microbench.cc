@@ -0,0 +1,265 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Microbenchmarks for the hot kernels of the backup path: hash
+ * implementations, the content-defined chunker, exclude pattern matching,
+ * and local database object lookups.  Run via "make bench" (which also runs
+ * the end-to-end benchmark in tests/run-benchmark); results are printed one
+ * per line as "name: value unit" so they can be diffed between releases. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <string>
+#include <vector>
+
+#include "exclude.h"
+#include "hash.h"
+#include "localdb.h"
+#include "ref.h"
+#include "util.h"
+#include "third_party/chunk.h"
+
+using std::string;
+using std::vector;
+
+static double timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill a buffer with deterministic pseudorandom data (so results are
+ * comparable across runs and machines). */
+static void fill_random(char *buf, size_t len)
+{
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(buf + i, &state, 8);
+    }
+}
+
+/* ========================== HASH BENCHMARK ========================== */
+
+static void bench_hash(const char *algorithm, const char *buf, size_t len)
+{
+    Hash *hash = Hash::New(algorithm);
+    if (hash == NULL) {
+        printf("hash.%s: unavailable\n", algorithm);
+        return;
+    }
+
+    double start = timestamp();
+    const size_t block = 1 << 20;
+    for (size_t i = 0; i < len; i += block)
+        hash->update(buf + i, std::min(block, len - i));
+    hash->digest();
+    double elapsed = timestamp() - start;
+    delete hash;
+
+    printf("hash.%s: %.1f MB/s\n", algorithm,
+           len / elapsed / (1 << 20));
+}
+
+/* ========================== CHUNKER BENCHMARK ========================== */
+
+static void bench_chunker(const char *algorithm, const char *buf, size_t len)
+{
+    if (!chunk_select_algorithm(algorithm)) {
+        printf("chunker.%s: unavailable\n", algorithm);
+        return;
+    }
+
+    vector<size_t> breakpoints(chunk_compute_max_num_breaks(len));
+
+    double start = timestamp();
+    int count = chunk_compute_breaks(buf, len, &breakpoints[0]);
+    double elapsed = timestamp() - start;
+
+    printf("chunker.%s: %.1f MB/s (%d chunks, %.1f KiB average)\n",
+           algorithm, len / elapsed / (1 << 20), count,
+           (double)len / count / 1024);
+}
+
+/* ========================== EXCLUDE BENCHMARK ========================== */
+
+static void bench_exclude(const char *label, const char *pattern,
+                          const vector<string> &paths, int rounds)
+{
+    FilePattern *p = new FilePattern(pattern, "");
+    p->ref();
+
+    int matched = 0;
+    double start = timestamp();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (p->matches(paths[i]))
+                matched++;
+        }
+    }
+    double elapsed = timestamp() - start;
+    p->unref();
+
+    printf("exclude.%s: %.2f Mmatches/s (%d hits)\n", label,
+           rounds * paths.size() / elapsed / 1e6, matched / rounds);
+}
+
+/* ========================== LOCALDB BENCHMARK ==========================
+ *
+ * Build a synthetic local database (using the normal schema from
+ * schema.sql), populate it with objects, and measure FindObject lookups for
+ * both present and absent checksums. */
+
+static bool create_database(const string &path, const char *schema_path)
+{
+    FILE *f = fopen(schema_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s; skipping localdb benchmark\n",
+                schema_path);
+        return false;
+    }
+    string schema;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        schema.append(buf, n);
+    fclose(f);
+
+    sqlite3 *db;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+        return false;
+    if (sqlite3_exec(db, schema.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+        sqlite3_close(db);
+        return false;
+    }
+    sqlite3_close(db);
+    return true;
+}
+
+static string synthetic_checksum(int i)
+{
+    return string_printf("sha224=%056x", i);
+}
+
+static void bench_localdb(const char *schema_path)
+{
+    char tmpdir[] = "/tmp/cumulus-bench.XXXXXX";
+    if (mkdtemp(tmpdir) == NULL)
+        fatal("Cannot create temporary directory");
+    string dbpath = string(tmpdir) + "/localdb.sqlite";
+
+    if (!create_database(dbpath, schema_path)) {
+        rmdir(tmpdir);
+        return;
+    }
+
+    const int num_objects = 100000;
+    const int lookups = 1000000;
+
+    LocalDb db;
+    db.Open(dbpath.c_str(), "20260101T000000", "bench");
+
+    string segment = generate_uuid();
+    double start = timestamp();
+    for (int i = 0; i < num_objects; i++) {
+        if (i % 1000 == 0)
+            segment = generate_uuid();
+        ObjectReference ref(segment, i % 1000);
+        ref.set_checksum(synthetic_checksum(i));
+        ref.set_range(0, 4096 + (i % 4096), true);
+        db.StoreObject(ref, 0.0);
+    }
+    double elapsed = timestamp() - start;
+    printf("localdb.store: %.0f objects/s\n", num_objects / elapsed);
+
+    int found = 0;
+    start = timestamp();
+    for (int i = 0; i < lookups; i++) {
+        int n = i % num_objects;
+        ObjectReference ref = db.FindObject(synthetic_checksum(n),
+                                            4096 + (n % 4096));
+        if (!ref.is_null())
+            found++;
+    }
+    elapsed = timestamp() - start;
+    printf("localdb.find.hit: %.0f lookups/s (%d found)\n",
+           lookups / elapsed, found);
+
+    const int misses = 10000;
+    start = timestamp();
+    for (int i = 0; i < misses; i++) {
+        db.FindObject(synthetic_checksum(num_objects + i), 512);
+    }
+    elapsed = timestamp() - start;
+    printf("localdb.find.miss: %.0f lookups/s\n", misses / elapsed);
+
+    db.Close();
+    unlink(dbpath.c_str());
+    rmdir(tmpdir);
+}
+
+int main(int argc, char *argv[])
+{
+    hash_init();
+
+    const char *schema_path = "schema.sql";
+    if (argc > 1)
+        schema_path = argv[1];
+
+    const size_t data_size = 64 << 20;
+    char *buf = new char[data_size];
+    fill_random(buf, data_size);
+
+    bench_hash("sha1", buf, data_size);
+    bench_hash("sha224", buf, data_size);
+    bench_hash("sha256", buf, data_size);
+
+    bench_chunker("lbfs", buf, data_size);
+    bench_chunker("fastcdc", buf, data_size);
+
+    /* Synthetic paths resembling a source tree; one benchmark per matching
+     * strategy (literal, suffix, regex). */
+    vector<string> paths;
+    for (int d = 0; d < 100; d++) {
+        for (int f = 0; f < 10; f++) {
+            paths.push_back(string_printf("home/user/project%d/src/file%d.c",
+                                          d, f));
+            paths.push_back(string_printf("home/user/project%d/obj/file%d.o",
+                                          d, f));
+        }
+    }
+    bench_exclude("literal", "/home/user/project0", paths, 500);
+    bench_exclude("suffix", "*.o", paths, 500);
+    bench_exclude("regex", "*project[0-4]?/src/*", paths, 500);
+
+    bench_localdb(schema_path);
+
+    delete[] buf;
+    return 0;
+}
@@ -80,12 +80,83 @@ ObjectReference::ObjectReference(const std::string& segment,
     clear_range();
 }
 
+/* Compare two references field by field, replicating exactly which fields
+ * to_string() encodes: checksums and ranges are only significant when
+ * present, and an exact (or zero-reference) range does not include a start
+ * offset. */
+bool ObjectReference::operator==(const ObjectReference &x) const
+{
+    if (type != x.type)
+        return false;
+    if (type == REF_NULL)
+        return true;
+
+    if (type == REF_NORMAL) {
+        if (segment != x.segment || object != x.object)
+            return false;
+        if (checksum_valid != x.checksum_valid)
+            return false;
+        if (checksum_valid && checksum != x.checksum)
+            return false;
+    }
+
+    if (range_valid != x.range_valid)
+        return false;
+    if (range_valid) {
+        if (range_length != x.range_length)
+            return false;
+        bool exact1 = range_exact || type == REF_ZERO;
+        bool exact2 = x.range_exact || x.type == REF_ZERO;
+        if (exact1 != exact2)
+            return false;
+        if (!exact1 && range_start != x.range_start)
+            return false;
+    }
+
+    return true;
+}
+
+bool ObjectReference::operator<(const ObjectReference &x) const
+{
+    if (type != x.type)
+        return type < x.type;
+    if (type == REF_NULL)
+        return false;
+
+    if (type == REF_NORMAL) {
+        if (segment != x.segment)
+            return segment < x.segment;
+        if (object != x.object)
+            return object < x.object;
+        if (checksum_valid != x.checksum_valid)
+            return checksum_valid < x.checksum_valid;
+        if (checksum_valid && checksum != x.checksum)
+            return checksum < x.checksum;
+    }
+
+    if (range_valid != x.range_valid)
+        return range_valid < x.range_valid;
+    if (range_valid) {
+        bool exact1 = range_exact || type == REF_ZERO;
+        bool exact2 = x.range_exact || x.type == REF_ZERO;
+        if (exact1 != exact2)
+            return exact1 < exact2;
+        if (!exact1 && range_start != x.range_start)
+            return range_start < x.range_start;
+        if (range_length != x.range_length)
+            return range_length < x.range_length;
+    }
+
+    return false;
+}
+
 string ObjectReference::to_string() const
 {
     if (type == REF_NULL)
         return "null";
 
     string result;
+    result.reserve(64);
     if (type == REF_ZERO) {
         result = "zero";
     } else if (type == REF_NORMAL) {
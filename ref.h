@@ -96,13 +96,13 @@ public:
     std::string to_string() const;
     static ObjectReference parse(const std::string& s);
 
-    std::string get_segment() const { return segment; }
-    std::string get_sequence() const { return object; }
+    const std::string &get_segment() const { return segment; }
+    const std::string &get_sequence() const { return object; }
     std::string get_basename() const { return segment + "/" + object; }
     ObjectReference base() const { return ObjectReference(segment, object); }
 
     bool has_checksum() const { return checksum_valid; }
-    std::string get_checksum() const { return checksum; }
+    const std::string &get_checksum() const { return checksum; }
     void clear_checksum() { checksum = ""; checksum_valid = false; }
     void set_checksum(const std::string& checksum)
         { this->checksum = checksum; checksum_valid = true; }
@@ -120,11 +120,12 @@ public:
 
     bool merge(ObjectReference ref);
 
-    // Maybe provide non-string implementations?
-    bool operator==(const ObjectReference &x) const
-        { return to_string() == x.to_string(); }
-    bool operator<(const ObjectReference &x) const
-        { return to_string() < x.to_string(); }
+    /* Comparisons are done field-wise, without formatting the references as
+     * text; equality agrees with comparing the to_string() forms.  The
+     * ordering is only used for in-memory containers and is not the
+     * lexicographic order of the text representation. */
+    bool operator==(const ObjectReference &x) const;
+    bool operator<(const ObjectReference &x) const;
 
 private:
     RefType type;
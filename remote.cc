@@ -39,6 +39,7 @@
 #include <list>
 #include <string>
 
+#include "metrics.h"
 #include "remote.h"
 #include "store.h"
 #include "util.h"
@@ -53,10 +54,12 @@ static const char *backup_directories[] = {
     NULL
 };
 
-RemoteStore::RemoteStore(const string &stagedir, const string &script)
+RemoteStore::RemoteStore(const string &stagedir, const string &script,
+                         int nthreads)
 {
     staging_dir = stagedir;
     backup_script = script;
+    this->nthreads = (nthreads < 1) ? 1 : nthreads;
 
     /* Ensure all necessary directories exist for each type of backup file. */
     for (size_t i = 0; backup_directories[i]; i++) {
@@ -71,23 +74,29 @@ RemoteStore::RemoteStore(const string &stagedir, const string &script)
         }
     }
 
-    /* A background thread is created for each RemoteStore to manage the actual
-     * transfers to a remote server.  The main program thread can enqueue
-     * RemoteFile objects to be transferred asynchronously. */
+    /* A pool of background threads is created for each RemoteStore to manage
+     * the actual transfers to a remote server; each thread launches its own
+     * copy of the upload script, so up to nthreads files are in flight
+     * concurrently.  The main program thread can enqueue RemoteFile objects
+     * to be transferred asynchronously. */
     pthread_mutex_init(&lock, NULL);
     pthread_cond_init(&cond, NULL);
     terminate = false;
-    busy = true;
+    active = 0;
     files_outstanding = 0;
 
-    if (pthread_create(&thread, NULL, RemoteStore::start_transfer_thread,
-                       (void *)this) != 0) {
-        fprintf(stderr, "Cannot create remote storage thread: %m\n");
-        fatal("pthread_create");
+    for (int i = 0; i < this->nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, RemoteStore::start_transfer_thread,
+                           (void *)this) != 0) {
+            fprintf(stderr, "Cannot create remote storage thread: %m\n");
+            fatal("pthread_create");
+        }
+        threads.push_back(thread);
     }
 }
 
-/* The RemoteStore destructor will terminate the background transfer thread.
+/* The RemoteStore destructor will terminate the background transfer threads.
  * It will wait for all work to finish. */
 RemoteStore::~RemoteStore()
 {
@@ -96,8 +105,10 @@ RemoteStore::~RemoteStore()
     pthread_cond_broadcast(&cond);
     pthread_mutex_unlock(&lock);
 
-    if (pthread_join(thread, NULL) != 0) {
-        fprintf(stderr, "Warning: Unable to join storage thread: %m\n");
+    for (size_t i = 0; i < threads.size(); i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Warning: Unable to join storage thread: %m\n");
+        }
     }
 
     assert(files_outstanding == 0);
@@ -128,12 +139,14 @@ void RemoteStore::enqueue(RemoteFile *file)
 {
     pthread_mutex_lock(&lock);
 
-    while (transfer_queue.size() >= MAX_QUEUE_SIZE)
-        pthread_cond_wait(&cond, &lock);
+    if (transfer_queue.size() >= MAX_QUEUE_SIZE * nthreads) {
+        MetricsTimer wait_timer(METRICS_UPLOAD_WAIT);
+        while (transfer_queue.size() >= MAX_QUEUE_SIZE * nthreads)
+            pthread_cond_wait(&cond, &lock);
+    }
 
     transfer_queue.push_back(file);
     files_outstanding--;
-    busy = true;
 
     pthread_cond_broadcast(&cond);
     pthread_mutex_unlock(&lock);
@@ -142,14 +155,35 @@ void RemoteStore::enqueue(RemoteFile *file)
 /* Wait for all transfers to finish. */
 void RemoteStore::sync()
 {
+    MetricsTimer wait_timer(METRICS_UPLOAD_WAIT);
     pthread_mutex_lock(&lock);
 
-    while (busy)
+    while (!transfer_queue.empty() || active > 0)
         pthread_cond_wait(&cond, &lock);
 
     pthread_mutex_unlock(&lock);
 }
 
+/* Select the next file to transfer; the caller must hold the lock.  Segment
+ * data is given priority over "meta" and "snapshots" files, so that the
+ * metadata and backup descriptor land on the server after the segments they
+ * describe whenever transfers are backlogged. */
+RemoteFile *RemoteStore::dequeue_locked()
+{
+    std::list<RemoteFile *>::iterator chosen = transfer_queue.begin();
+    for (std::list<RemoteFile *>::iterator i = transfer_queue.begin();
+         i != transfer_queue.end(); ++i) {
+        if ((*i)->type != "meta" && (*i)->type != "snapshots") {
+            chosen = i;
+            break;
+        }
+    }
+
+    RemoteFile *file = *chosen;
+    transfer_queue.erase(chosen);
+    return file;
+}
+
 void *RemoteStore::start_transfer_thread(void *arg)
 {
     RemoteStore *store = static_cast<RemoteStore *>(arg);
@@ -157,7 +191,9 @@ void *RemoteStore::start_transfer_thread(void *arg)
     return NULL;
 }
 
-/* Background thread for transferring backups to a remote server. */
+/* Background threads for transferring backups to a remote server.  Each
+ * thread launches its own copy of the upload script (if one is configured),
+ * so transfers proceed concurrently. */
 void RemoteStore::transfer_thread()
 {
     /* If a transfer script was specified, launch it and connect to both stdin
@@ -208,19 +244,14 @@ void RemoteStore::transfer_thread()
         // Wait for a file to transfer
         pthread_mutex_lock(&lock);
         while (transfer_queue.empty() && !terminate) {
-            busy = false;
-            pthread_cond_broadcast(&cond);
             pthread_cond_wait(&cond, &lock);
         }
         if (terminate && transfer_queue.empty()) {
-            busy = false;
-            pthread_cond_broadcast(&cond);
             pthread_mutex_unlock(&lock);
             break;
         }
-        busy = true;
-        file = transfer_queue.front();
-        transfer_queue.pop_front();
+        file = dequeue_locked();
+        active++;
         pthread_cond_broadcast(&cond);
         pthread_mutex_unlock(&lock);
 
@@ -250,6 +281,11 @@ void RemoteStore::transfer_thread()
         }
 
         delete file;
+
+        pthread_mutex_lock(&lock);
+        active--;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
     }
 
     if (fd_in) fclose(fd_in);
@@ -30,28 +30,33 @@
 
 #include <list>
 #include <string>
+#include <vector>
 #include <pthread.h>
 
 class RemoteFile;
 
 class RemoteStore {
 public:
+    /* Maximum number of queued files per transfer thread before enqueue
+     * blocks. */
     static const size_t MAX_QUEUE_SIZE = 4;
 
-    RemoteStore(const std::string &stagedir, const std::string &script = "");
+    RemoteStore(const std::string &stagedir, const std::string &script = "",
+                int nthreads = 1);
     ~RemoteStore();
     RemoteFile *alloc_file(const std::string &name, const std::string &type);
     void enqueue(RemoteFile *file);
     void sync();
 
 private:
-    pthread_t thread;
+    std::vector<pthread_t> threads;
     pthread_mutex_t lock;
     pthread_cond_t cond;
 
     std::string staging_dir, backup_script;
-    bool terminate;             // Set when thread should shut down
-    bool busy;                  // True while there are pending transfers
+    int nthreads;               // Number of concurrent transfer threads
+    bool terminate;             // Set when threads should shut down
+    int active;                 // Number of transfers currently in progress
     std::list<RemoteFile *> transfer_queue;
 
     /* For error-checking purposes, track the number of files which have been
@@ -59,6 +64,7 @@ private:
      * RemoteStore is destroyed. */
     int files_outstanding;
 
+    RemoteFile *dequeue_locked();
     void transfer_thread();
     static void *start_transfer_thread(void *arg);
 };
@@ -0,0 +1,564 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2008-2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Native segment garbage collection and repacking.  As snapshots are deleted,
+ * segments written by old backups become poorly utilized: only a fraction of
+ * their objects are still referenced, but the whole segment must be kept (and
+ * fetched on restore).  This tool identifies such segments using the
+ * utilization estimates maintained in the local database, copies their live
+ * objects into fresh segments, and expires the old copies so that no future
+ * snapshot will reference them.
+ *
+ * This replaces the lazy cleaning flow of "cumulus-util clean", which only
+ * marks segments expired and then relies on the next backup to re-read and
+ * re-upload the affected file data.  Here the live objects are streamed
+ * directly from the old segments into new ones, so cleaning cost is
+ * proportional to the amount of live data moved, not to the size of the next
+ * backup.
+ *
+ * Repacked objects are written into "compacted-N" object groups, binned by
+ * age, matching the segment layout the backup process itself produces when it
+ * rewrites expired objects: data of similar age is placed together, in the
+ * hope that it will expire together.
+ *
+ * The old segment files are not deleted: snapshots taken before the repack
+ * still reference them, so they can only be removed (with
+ * "cumulus-util delete-garbage") once those snapshots have been pruned.
+ * Snapshots taken after the repack will reference only the new segments. */
+
+#include <ctype.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "localdb.h"
+#include "remote.h"
+#include "segment.h"
+#include "store.h"
+#include "util.h"
+
+using std::list;
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+#ifndef CUMULUS_VERSION
+#define CUMULUS_VERSION Unknown
+#endif
+#define CUMULUS_STRINGIFY(s) CUMULUS_STRINGIFY2(s)
+#define CUMULUS_STRINGIFY2(s) #s
+static const char cumulus_version[] = CUMULUS_STRINGIFY(CUMULUS_VERSION);
+
+/* Maximum number of levels of indirection when following references in the
+ * metadata log; matches MAX_RECURSION_DEPTH in the Python implementation. */
+static const int MAX_RECURSION_DEPTH = 3;
+
+/* The root of the storage directory being repacked. */
+static string store_root;
+
+/* ========================== LIVENESS SCAN ==========================
+ *
+ * The local database records only per-segment utilization estimates, not
+ * which individual objects are still referenced.  To find the live objects,
+ * walk the metadata logs of every snapshot the database still tracks and
+ * collect all object references, exactly as a restore of each snapshot
+ * would.  The scan only ever loads metadata segments (data block references
+ * are recorded, not fetched), so its cost is proportional to the metadata
+ * size. */
+
+struct LivenessScan {
+    map<string, map<string, string> > segments; // Loaded metadata segments
+    set<string> live;                           // "<segment>/<sequence>"
+};
+
+/* Fetch the contents of an object holding metadata (a metadata log block or
+ * an indirect block list), loading its segment on first use. */
+static string scan_fetch(LivenessScan *scan, const ObjectReference &ref)
+{
+    const string &segment = ref.get_segment();
+    map<string, map<string, string> >::iterator s
+        = scan->segments.find(segment);
+    if (s == scan->segments.end()) {
+        map<string, string> &objects = scan->segments[segment];
+        if (!segment_load(store_root, segment, &objects))
+            fatal("Segment not found: " + segment);
+        s = scan->segments.find(segment);
+    }
+
+    map<string, string>::const_iterator o
+        = s->second.find(ref.get_sequence());
+    if (o == s->second.end())
+        fatal("Object " + ref.to_string() + " not found");
+
+    string data = o->second;
+    if (ref.has_range() && !ref.range_is_exact())
+        data = data.substr(ref.get_range_start(), ref.get_range_length());
+    return data;
+}
+
+static void mark_live(LivenessScan *scan, const ObjectReference &ref)
+{
+    scan->live.insert(ref.get_segment() + "/" + ref.get_sequence());
+}
+
+/* Record all object references in a whitespace-separated block list,
+ * following "@" indirections. */
+static void scan_block_list(LivenessScan *scan, const string &value,
+                            int depth = 0)
+{
+    if (depth >= MAX_RECURSION_DEPTH)
+        fatal("Too many levels of indirection in block list");
+
+    size_t i = 0;
+    while (i < value.size()) {
+        while (i < value.size() && isspace(value[i]))
+            i++;
+        if (i >= value.size())
+            break;
+        size_t j = i;
+        while (j < value.size() && !isspace(value[j]))
+            j++;
+        string token = value.substr(i, j - i);
+        i = j;
+
+        if (token[0] == '@') {
+            ObjectReference indirect = ObjectReference::parse(token.substr(1));
+            if (indirect.is_null())
+                fatal("Invalid indirect block reference: " + token);
+            mark_live(scan, indirect);
+            scan_block_list(scan, scan_fetch(scan, indirect), depth + 1);
+        } else {
+            ObjectReference ref = ObjectReference::parse(token);
+            if (ref.is_normal())
+                mark_live(scan, ref);
+        }
+    }
+}
+
+/* Walk a metadata log, marking the log objects themselves and every data
+ * block they reference as live. */
+static void scan_metadata_log(LivenessScan *scan, const ObjectReference &root,
+                              int depth = 0)
+{
+    if (depth >= MAX_RECURSION_DEPTH)
+        fatal("Too many levels of indirection in metadata log");
+
+    mark_live(scan, root);
+    string data = scan_fetch(scan, root);
+
+    /* Pick the "data" fields out of the metadata stanzas, taking care of
+     * continuation lines (which begin with whitespace). */
+    string block_list = "";
+    bool in_data = false;
+
+    size_t i = 0;
+    while (i <= data.size()) {
+        size_t j = data.find('\n', i);
+        if (j == string::npos)
+            j = data.size();
+        string line = data.substr(i, j - i);
+        i = j + 1;
+
+        if (!line.empty() && line[0] == '@') {
+            ObjectReference ref = ObjectReference::parse(line.substr(1));
+            if (ref.is_null())
+                fatal("Invalid indirect reference in metadata log: " + line);
+            scan_metadata_log(scan, ref, depth + 1);
+            continue;
+        }
+
+        if (in_data && !line.empty() && isspace(line[0])) {
+            block_list += " " + line;
+            continue;
+        }
+        if (in_data) {
+            scan_block_list(scan, block_list);
+            block_list = "";
+            in_data = false;
+        }
+        if (line.compare(0, 5, "data:") == 0) {
+            block_list = line.substr(5);
+            in_data = true;
+        }
+    }
+}
+
+/* Mark everything referenced by the named snapshot as live, starting from its
+ * descriptor in the store. */
+static void scan_snapshot(LivenessScan *scan,
+                          const LocalDb::SnapshotInfo &snapshot)
+{
+    static const char *const snapshot_dirs[] = { "snapshots", "", NULL };
+
+    string basename = "snapshot-";
+    if (snapshot.scheme.size() > 0)
+        basename += snapshot.scheme + "-";
+    basename += snapshot.name;
+
+    string data;
+    if (!store_load_file(store_root, snapshot_dirs, basename + ".cumulus",
+                         &data)
+        && !store_load_file(store_root, snapshot_dirs, basename + ".lbs",
+                            &data))
+        fatal("Snapshot descriptor not found: " + basename);
+
+    /* Find the Root: field of the descriptor. */
+    size_t i = 0;
+    while (i < data.size()) {
+        size_t j = data.find('\n', i);
+        if (j == string::npos)
+            j = data.size();
+        string line = data.substr(i, j - i);
+        i = j + 1;
+
+        if (line.compare(0, 5, "Root:") == 0) {
+            size_t start = 5;
+            while (start < line.size() && isspace(line[start]))
+                start++;
+            ObjectReference root
+                = ObjectReference::parse(line.substr(start));
+            if (root.is_null())
+                fatal("Invalid Root reference in " + basename);
+            scan_metadata_log(scan, root);
+            return;
+        }
+    }
+
+    fatal("Snapshot descriptor has no Root reference: " + basename);
+}
+
+/* ========================== SEGMENT SELECTION ========================== */
+
+/* A segment selected for repacking, with its computed cleaning benefit. */
+struct RepackCandidate {
+    LocalDb::SegmentStats stats;
+    double utilization;
+    double benefit;
+
+    bool operator<(const RepackCandidate &other) const {
+        return benefit > other.benefit;         // Sort best-first
+    }
+};
+
+/* Convert the current time to SQLite's Julian day representation, for
+ * computing object ages from block_index timestamps. */
+static double now_julian()
+{
+    return time(NULL) / 86400.0 + 2440587.5;
+}
+
+/* Choose the object group for a repacked block.  Blocks are binned coarsely
+ * by age (in days) so that data of similar age is placed in the same
+ * segments; group numbering starts at 1 since group 0 is, by the convention
+ * in dumpfile(), the same as the "data" group for new objects. */
+static string age_group(double age_days)
+{
+    if (age_days < 30)
+        return "compacted-1";
+    if (age_days < 90)
+        return "compacted-2";
+    if (age_days < 365)
+        return "compacted-3";
+    return "compacted-4";
+}
+
+static void usage(const char *program)
+{
+    fprintf(
+        stderr,
+        "Cumulus %s\n\n"
+        "Usage: %s [OPTION]... --localdb=PATH STORE\n"
+        "Repack poorly-utilized segments in a local Cumulus store.\n"
+        "\n"
+        "Options:\n"
+        "  --localdb=PATH       local backup metadata is stored in PATH\n"
+        "  --threshold=FLOAT    minimum cleaning benefit for a segment to be\n"
+        "                           repacked (defaults to 7.0)\n"
+        "  --age-boost=DAYS     add DAYS to each segment's age when computing\n"
+        "                           the cleaning benefit\n"
+        "  --filter=COMMAND     program through which to filter segment data\n"
+        "                           (defaults to \"bzip2 -c\")\n"
+        "  --filter-extension=EXT\n"
+        "                       string to append to segment files\n"
+        "                           (defaults to \".bz2\")\n"
+        "  --segment-size=SIZE  maximum segment size, in bytes (suffixes K, M,\n"
+        "                           and G are accepted; defaults to 4M)\n"
+        "  --dry-run            list the segments which would be repacked and\n"
+        "                           exit without modifying anything\n"
+        "  --decode-filter=EXT:COMMAND\n"
+        "                       decode segment files ending in EXT by piping\n"
+        "                           them through COMMAND (for stores written\n"
+        "                           with a non-default filter)\n",
+        cumulus_version, program);
+}
+
+int main(int argc, char *argv[])
+{
+    hash_init();
+
+    string localdb_dir = "";
+    double threshold = 7.0;
+    double age_boost = 0.0;
+    bool dry_run = false;
+
+    for (;;) {
+        static struct option long_options[] = {
+            {"localdb", 1, 0, 0},           // 0
+            {"threshold", 1, 0, 0},         // 1
+            {"age-boost", 1, 0, 0},         // 2
+            {"filter", 1, 0, 0},            // 3
+            {"filter-extension", 1, 0, 0},  // 4
+            {"segment-size", 1, 0, 0},      // 5
+            {"dry-run", 0, 0, 0},           // 6
+            {"decode-filter", 1, 0, 0},     // 7
+            {NULL, 0, 0, 0},
+        };
+
+        int long_index;
+        int c = getopt_long(argc, argv, "", long_options, &long_index);
+
+        if (c == -1)
+            break;
+
+        if (c == 0) {
+            switch (long_index) {
+            case 0:     // --localdb
+                localdb_dir = optarg;
+                break;
+            case 1:     // --threshold
+                threshold = atof(optarg);
+                break;
+            case 2:     // --age-boost
+                age_boost = atof(optarg);
+                break;
+            case 3:     // --filter
+                filter_program = optarg;
+                break;
+            case 4:     // --filter-extension
+                filter_extension = optarg;
+                break;
+            case 5: {   // --segment-size
+                char *suffix = NULL;
+                long long size = strtoll(optarg, &suffix, 0);
+                switch (*suffix) {
+                case 'k': case 'K': size <<= 10; suffix++; break;
+                case 'm': case 'M': size <<= 20; suffix++; break;
+                case 'g': case 'G': size <<= 30; suffix++; break;
+                }
+                if (*suffix != '\0' || size < 1 << 20) {
+                    fprintf(stderr, "Error: Invalid segment size: %s\n",
+                            optarg);
+                    return 1;
+                }
+                segment_size_limit = size;
+                break;
+            }
+            case 6:     // --dry-run
+                dry_run = true;
+                break;
+            case 7:     // --decode-filter
+                if (!segment_parse_filter_option(optarg)) {
+                    fprintf(stderr, "Invalid decode filter (expected "
+                            "EXT:COMMAND): %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Unhandled long option!\n");
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1 || localdb_dir == "") {
+        usage(argv[0]);
+        return 1;
+    }
+
+    store_root = argv[optind];
+    while (store_root.size() > 1 && store_root[store_root.size() - 1] == '/')
+        store_root.erase(store_root.size() - 1);
+
+    LocalDb db;
+    db.Open((localdb_dir + "/localdb.sqlite").c_str(), NULL, NULL);
+
+    /* Determine which objects are still referenced by walking the metadata
+     * of every snapshot the database tracks.  Anything not found here is
+     * garbage and will not be copied. */
+    LivenessScan scan;
+    list<LocalDb::SnapshotInfo> snapshots = db.GetSnapshots();
+    for (list<LocalDb::SnapshotInfo>::const_iterator i = snapshots.begin();
+         i != snapshots.end(); ++i)
+        scan_snapshot(&scan, *i);
+    printf("Scanned %d snapshots: %d live objects\n",
+           (int)snapshots.size(), (int)scan.live.size());
+
+    /* Select the repacking candidates: data segments (never metadata
+     * segments, whose objects are referenced directly by snapshot
+     * descriptors) whose estimated cleaning benefit exceeds the threshold.
+     * The benefit heuristic matches the Python segment cleaner: it rewards
+     * reclaimable space (1 - u) and age, and penalizes the cost of rewriting
+     * the live data (u + 0.1). */
+    vector<RepackCandidate> candidates;
+    list<LocalDb::SegmentStats> stats = db.GetSegmentStatistics();
+    for (list<LocalDb::SegmentStats>::const_iterator i = stats.begin();
+         i != stats.end(); ++i) {
+        if (i->type != "data" && i->type.compare(0, 9, "compacted") != 0)
+            continue;
+        if (i->data_size <= 0)
+            continue;
+
+        RepackCandidate candidate;
+        candidate.stats = *i;
+        candidate.utilization
+            = std::min(1.0, (double)i->bytes_referenced / i->data_size);
+        candidate.benefit = (1 - candidate.utilization)
+            * (i->age_days + age_boost) / (candidate.utilization + 0.1);
+        if (candidate.benefit > threshold)
+            candidates.push_back(candidate);
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    if (candidates.empty()) {
+        printf("No segments need repacking.\n");
+        db.Close();
+        return 0;
+    }
+
+    if (dry_run) {
+        printf("Segments to repack:\n");
+        for (size_t i = 0; i < candidates.size(); i++) {
+            const RepackCandidate &c = candidates[i];
+            printf("    %s: %.0f%% utilized, %lld bytes live, "
+                   "benefit %.2f\n",
+                   c.stats.name.c_str(), 100 * c.utilization,
+                   (long long)c.stats.bytes_referenced, c.benefit);
+        }
+        db.Close();
+        return 0;
+    }
+
+    RemoteStore *remote = new RemoteStore(store_root, "", 1);
+    TarSegmentStore *tss = new TarSegmentStore(remote, &db);
+
+    double now = now_julian();
+    int segments_repacked = 0;
+    int64_t bytes_copied = 0, disk_retired = 0;
+    map<string, int64_t> new_segment_bytes;
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const LocalDb::SegmentStats &seg = candidates[i].stats;
+
+        /* Restrict the unexpired objects recorded in the database to those
+         * actually referenced by some tracked snapshot. */
+        list<LocalDb::BlockInfo> blocks = db.GetLiveBlocks(seg.name);
+        for (list<LocalDb::BlockInfo>::iterator b = blocks.begin();
+             b != blocks.end(); ) {
+            if (scan.live.count(seg.name + "/" + b->object) == 0)
+                b = blocks.erase(b);
+            else
+                ++b;
+        }
+
+        map<string, string> objects;
+        if (!segment_load(store_root, seg.name, &objects)) {
+            fprintf(stderr, "Warning: Segment %s not found in store; "
+                    "skipping\n", seg.name.c_str());
+            continue;
+        }
+
+        /* Validate the whole segment before copying anything out of it, so a
+         * corrupt or incomplete segment is left untouched rather than
+         * half-expired. */
+        bool ok = true;
+        for (list<LocalDb::BlockInfo>::const_iterator b = blocks.begin();
+             b != blocks.end(); ++b) {
+            map<string, string>::const_iterator o = objects.find(b->object);
+            if (o == objects.end()
+                || (int64_t)o->second.size() != b->size
+                || b->checksum.empty()) {
+                fprintf(stderr, "Warning: Segment %s has a missing or "
+                        "mismatched object (%s); skipping\n",
+                        seg.name.c_str(), b->object.c_str());
+                ok = false;
+                break;
+            }
+        }
+        if (!ok)
+            continue;
+
+        int64_t seg_bytes = 0;
+        for (list<LocalDb::BlockInfo>::const_iterator b = blocks.begin();
+             b != blocks.end(); ++b) {
+            const string &data = objects[b->object];
+            ObjectReference ref
+                = tss->write_object(data.data(), data.size(),
+                                    age_group(now - b->age),
+                                    b->checksum, b->age);
+            new_segment_bytes[ref.get_segment()] += data.size();
+            seg_bytes += data.size();
+        }
+        bytes_copied += seg_bytes;
+
+        db.ExpireSegment(seg.name);
+        segments_repacked++;
+        disk_retired += seg.disk_size;
+        printf("Repacked segment %s (%lld of %lld bytes live)\n",
+               seg.name.c_str(), (long long)seg_bytes,
+               (long long)seg.data_size);
+    }
+
+    /* Finalize the new segments (the destructors wait for compression and
+     * checksumming to finish), then record their contents as live so database
+     * garbage collection keeps them until the next backup references them. */
+    delete tss;
+    delete remote;
+
+    for (map<string, int64_t>::const_iterator i = new_segment_bytes.begin();
+         i != new_segment_bytes.end(); ++i)
+        db.RecordSegmentReferences(i->first, i->second);
+
+    /* Carry the sub-block chunk signatures over to the new copies, so
+     * repacking does not degrade later sub-file incrementals. */
+    db.MigrateChunkSignatures();
+
+    db.Close();
+
+    printf("Repacked %d segments: %lld live bytes copied into %d new "
+           "segments, %lld bytes on disk retired\n",
+           segments_repacked, (long long)bytes_copied,
+           (int)new_segment_bytes.size(), (long long)disk_retired);
+    printf("Old segment files remain until the snapshots referencing them "
+           "are pruned\n(see cumulus-util delete-garbage).\n");
+
+    return 0;
+}
@@ -0,0 +1,870 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2008-2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Native restore engine.  This is a C++ counterpart to the Python
+ * restore-snapshot command, built for speed: all needed segments are planned
+ * from the metadata log up front, segments are fetched and decompressed by a
+ * pool of worker threads, and file data is written with large sequential
+ * writes (with runs of zeroes restored as holes).  Only local (filesystem)
+ * storage and the standard gzip/bzip2 segment filters are handled natively;
+ * for encrypted stores or remote backends the Python tools remain the
+ * fallback. */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "ref.h"
+#include "segment.h"
+#include "store.h"
+#include "util.h"
+
+using std::list;
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+#ifndef CUMULUS_VERSION
+#define CUMULUS_VERSION Unknown
+#endif
+#define CUMULUS_STRINGIFY(s) CUMULUS_STRINGIFY2(s)
+#define CUMULUS_STRINGIFY2(s) #s
+static const char cumulus_version[] = CUMULUS_STRINGIFY(CUMULUS_VERSION);
+
+/* Maximum number of levels of indirection when following references in the
+ * metadata log; matches MAX_RECURSION_DEPTH in the Python implementation. */
+static const int MAX_RECURSION_DEPTH = 3;
+
+static int num_threads = 1;
+
+/* The root of the storage directory that snapshots are read from. */
+static string store_root;
+
+/* Count of non-fatal errors (checksum mismatches, unwritable files)
+ * encountered during the restore; reported and reflected in the exit status
+ * at the end. */
+static int error_count = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report_error(const string &msg)
+{
+    pthread_mutex_lock(&error_lock);
+    error_count++;
+    pthread_mutex_unlock(&error_lock);
+
+    pthread_mutex_lock(&print_lock);
+    fprintf(stderr, "Error: %s\n", msg.c_str());
+    pthread_mutex_unlock(&print_lock);
+}
+
+static void report_progress(const char *action, const string &path)
+{
+    pthread_mutex_lock(&print_lock);
+    printf("%s: %s\n", action, path.c_str());
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Write a buffer fully to a file descriptor, looping over partial writes. */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += res;
+        len -= res;
+    }
+    return true;
+}
+
+/* ========================== SEGMENT CACHE ==========================
+ *
+ * A bounded cache of loaded (decompressed and split) segments, shared by all
+ * restore worker threads.  If two threads need the same segment only one
+ * loads it; the others wait.  Decompression happens outside the cache lock,
+ * so distinct segments are loaded in parallel. */
+
+class SegmentCache {
+public:
+    SegmentCache(size_t size_limit) : limit(size_limit) {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    /* Return the contents of the given object, loading its segment into the
+     * cache first if needed.  Terminates the program if the segment cannot be
+     * found or an object is missing, as nothing useful can be restored from a
+     * store with missing segments. */
+    string get_object(const string &segment, const string &object)
+    {
+        Entry *entry = lookup(segment);
+
+        string result;
+        map<string, string>::const_iterator i
+            = entry->objects.find(object);
+        if (i == entry->objects.end())
+            fatal("Object " + segment + "/" + object + " not found");
+        result = i->second;
+
+        release(entry);
+        return result;
+    }
+
+private:
+    struct Entry {
+        bool ready;
+        int users;              // Threads currently reading from the entry
+        map<string, string> objects;
+    };
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t limit;
+    map<string, Entry *> cache;
+    list<string> lru;           // Most-recently-used segment last
+
+    /* Find (or load) a segment and return its cache entry with the use count
+     * incremented; pair with release(). */
+    Entry *lookup(const string &segment)
+    {
+        pthread_mutex_lock(&lock);
+
+        for (;;) {
+            map<string, Entry *>::iterator i = cache.find(segment);
+            if (i == cache.end())
+                break;
+            if (i->second->ready) {
+                Entry *entry = i->second;
+                entry->users++;
+                touch(segment);
+                pthread_mutex_unlock(&lock);
+                return entry;
+            }
+            /* Another thread is loading this segment; wait for it. */
+            pthread_cond_wait(&cond, &lock);
+        }
+
+        Entry *entry = new Entry;
+        entry->ready = false;
+        entry->users = 1;
+        cache[segment] = entry;
+        pthread_mutex_unlock(&lock);
+
+        if (!segment_load(store_root, segment, &entry->objects))
+            fatal("Segment not found: " + segment);
+
+        pthread_mutex_lock(&lock);
+        entry->ready = true;
+        lru.push_back(segment);
+        evict();
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+        return entry;
+    }
+
+    void release(Entry *entry)
+    {
+        pthread_mutex_lock(&lock);
+        entry->users--;
+        evict();
+        pthread_mutex_unlock(&lock);
+    }
+
+    /* Move a segment to the most-recently-used end of the LRU list.  Called
+     * with the lock held. */
+    void touch(const string &segment)
+    {
+        list<string>::iterator i = std::find(lru.begin(), lru.end(), segment);
+        if (i != lru.end())
+            lru.splice(lru.end(), lru, i);
+    }
+
+    /* Drop least-recently-used idle segments until the cache is back under
+     * its size limit.  Called with the lock held. */
+    void evict()
+    {
+        list<string>::iterator i = lru.begin();
+        while (cache.size() > limit && i != lru.end()) {
+            map<string, Entry *>::iterator c = cache.find(*i);
+            assert(c != cache.end());
+            if (c->second->users == 0) {
+                delete c->second;
+                cache.erase(c);
+                i = lru.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+};
+
+static SegmentCache *segment_cache;
+
+/* Fetch the data for a single object reference: zero references expand to
+ * zeroes, normal references are read from the segment cache and sliced. */
+static string load_ref(const ObjectReference &ref)
+{
+    if (!ref.is_normal()) {
+        assert(ref.has_range());
+        return string(ref.get_range_length(), '\0');
+    }
+
+    string data = segment_cache->get_object(ref.get_segment(),
+                                            ref.get_sequence());
+
+    if (ref.has_range()) {
+        if (ref.range_is_exact()) {
+            if (data.size() != ref.get_range_length())
+                fatal("Size mismatch for object " + ref.to_string());
+        } else {
+            if (ref.get_range_start() + ref.get_range_length() > data.size())
+                fatal("Range out of bounds for object " + ref.to_string());
+            data = data.substr(ref.get_range_start(),
+                               ref.get_range_length());
+        }
+    }
+
+    return data;
+}
+
+/* ========================== METADATA PARSING ========================== */
+
+/* A single entry (file, directory, ...) from the metadata log. */
+struct MetadataEntry {
+    dictionary fields;          // Raw key/value pairs from the log
+    string path;                // Decoded, normalized relative pathname
+    char type;
+    list<ObjectReference> data; // Data block references ('-' entries only)
+};
+
+/* Sanitize a pathname from the metadata log: strip leading slashes and "."
+ * components and refuse ".." so that a hostile snapshot cannot write outside
+ * the destination directory.  Returns the empty string if the path is
+ * unusable. */
+static string sanitize_path(const string &decoded)
+{
+    string result;
+    size_t i = 0;
+
+    while (i < decoded.size()) {
+        size_t j = decoded.find('/', i);
+        if (j == string::npos)
+            j = decoded.size();
+        string component = decoded.substr(i, j - i);
+        i = j + 1;
+
+        if (component.empty() || component == ".")
+            continue;
+        if (component == "..")
+            return "";
+        if (!result.empty())
+            result += "/";
+        result += component;
+    }
+
+    return result;
+}
+
+/* Read the complete metadata log, following "@" indirect references, and
+ * return it as a list of lines. */
+static void read_metadata_log(const ObjectReference &root,
+                              vector<string> *lines, int depth = 0)
+{
+    if (depth >= MAX_RECURSION_DEPTH)
+        fatal("Too many levels of indirection in metadata log");
+
+    string data = load_ref(root);
+
+    size_t i = 0;
+    while (i < data.size()) {
+        size_t j = data.find('\n', i);
+        if (j == string::npos)
+            j = data.size();
+        string line = data.substr(i, j - i);
+        i = j + 1;
+
+        if (!line.empty() && line[0] == '@') {
+            ObjectReference ref = ObjectReference::parse(line.substr(1));
+            if (ref.is_null())
+                fatal("Invalid indirect reference in metadata log: " + line);
+            read_metadata_log(ref, lines, depth + 1);
+        } else {
+            lines->push_back(line);
+        }
+    }
+}
+
+/* Expand the whitespace-separated list of data block references for a file,
+ * following "@" indirections. */
+static void parse_data_refs(const string &value, list<ObjectReference> *refs,
+                            int depth = 0)
+{
+    if (depth >= MAX_RECURSION_DEPTH)
+        fatal("Too many levels of indirection in block list");
+
+    size_t i = 0;
+    while (i < value.size()) {
+        while (i < value.size() && isspace(value[i]))
+            i++;
+        if (i >= value.size())
+            break;
+        size_t j = i;
+        while (j < value.size() && !isspace(value[j]))
+            j++;
+        string token = value.substr(i, j - i);
+        i = j;
+
+        if (token[0] == '@') {
+            ObjectReference indirect = ObjectReference::parse(token.substr(1));
+            if (indirect.is_null())
+                fatal("Invalid indirect block reference: " + token);
+            parse_data_refs(load_ref(indirect), refs, depth + 1);
+        } else {
+            ObjectReference ref = ObjectReference::parse(token);
+            if (ref.is_null() && token != "null")
+                fatal("Invalid block reference: " + token);
+            refs->push_back(ref);
+        }
+    }
+}
+
+/* Parse RFC822-style "Key: Value" data (with continuation lines marked by
+ * leading whitespace) into a sequence of dictionaries, one per blank-line
+ * delimited stanza. */
+static void parse_stanzas(const vector<string> &lines,
+                          vector<dictionary> *items)
+{
+    dictionary current;
+    string last_key;
+
+    for (size_t i = 0; i <= lines.size(); i++) {
+        const string line = (i < lines.size()) ? lines[i] : "";
+
+        if (line.empty()) {
+            if (!current.empty()) {
+                items->push_back(current);
+                current.clear();
+            }
+            last_key = "";
+            continue;
+        }
+
+        if (isspace(line[0])) {
+            if (!last_key.empty())
+                current[last_key] += line;
+            continue;
+        }
+
+        size_t colon = line.find(':');
+        if (colon == string::npos) {
+            last_key = "";
+            continue;
+        }
+        string key = line.substr(0, colon);
+        size_t start = colon + 1;
+        while (start < line.size() && isspace(line[start]))
+            start++;
+        current[key] = line.substr(start);
+        last_key = key;
+    }
+}
+
+/* Look up a field in a metadata dictionary, returning dflt if absent. */
+static string get_field(const dictionary &d, const string &key,
+                        const string &dflt = "")
+{
+    dictionary::const_iterator i = d.find(key);
+    return (i == d.end()) ? dflt : i->second;
+}
+
+/* Decode a "uid (name)" or "gid (name)" field, returning the numeric id. */
+static long long decode_user(const string &value)
+{
+    return parse_int(value.substr(0, value.find(' ')));
+}
+
+/* ========================== FILE RESTORE ========================== */
+
+static string dest_dir;
+
+/* Restore the contents of a single regular file from its block list.  Runs
+ * of zeroes (zero references) are restored as holes. */
+static void restore_file(const MetadataEntry &entry)
+{
+    string destpath = dest_dir + "/" + entry.path;
+
+    report_progress("extract", entry.path);
+
+    int fd = open(destpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        report_error("Unable to create " + destpath + ": "
+                     + strerror(errno));
+        return;
+    }
+
+    string checksum = get_field(entry.fields, "checksum");
+    Hash *verifier = NULL;
+    if (!checksum.empty()) {
+        size_t eq = checksum.find('=');
+        if (eq != string::npos)
+            verifier = Hash::New(checksum.substr(0, eq));
+        if (verifier == NULL)
+            fprintf(stderr,
+                    "Warning: Unknown checksum algorithm for %s: %s\n",
+                    entry.path.c_str(), checksum.c_str());
+    }
+
+    int64_t size = 0;
+    bool sparse = false;
+    bool write_error = false;
+
+    for (list<ObjectReference>::const_iterator i = entry.data.begin();
+         i != entry.data.end(); ++i) {
+        if (!i->is_normal()) {
+            /* Zero reference: seek past the hole instead of writing zeroes,
+             * but still feed them to the checksum. */
+            size_t len = i->get_range_length();
+            if (lseek(fd, len, SEEK_CUR) < 0) {
+                write_error = true;
+                break;
+            }
+            if (verifier != NULL) {
+                static const char zero_buf[65536] = { 0, };
+                size_t remaining = len;
+                while (remaining > 0) {
+                    size_t n = std::min(remaining, sizeof(zero_buf));
+                    verifier->update(zero_buf, n);
+                    remaining -= n;
+                }
+            }
+            size += len;
+            sparse = true;
+        } else {
+            string data = load_ref(*i);
+            if (verifier != NULL)
+                verifier->update(data.data(), data.size());
+            if (!write_all(fd, data.data(), data.size())) {
+                write_error = true;
+                break;
+            }
+            size += data.size();
+        }
+    }
+
+    /* If the file ends in a hole the seek above did not extend it. */
+    if (!write_error && sparse && ftruncate(fd, size) < 0)
+        write_error = true;
+
+    if (write_error)
+        report_error("Error writing " + destpath + ": " + strerror(errno));
+    close(fd);
+
+    if (!write_error) {
+        string expected_size = get_field(entry.fields, "size");
+        if (!expected_size.empty() && parse_int(expected_size) != size)
+            report_error("Size mismatch for " + entry.path);
+        if (verifier != NULL && verifier->digest_str() != checksum)
+            report_error("Checksum mismatch for " + entry.path);
+    }
+
+    delete verifier;
+}
+
+/* ========================== RESTORE DRIVER ========================== */
+
+/* The restore plan: files grouped by the first segment their data references,
+ * so that each worker processes one segment's files while the segment is hot
+ * in the cache.  Workers pull segments from the shared queue. */
+struct RestorePlan {
+    vector<MetadataEntry> *entries;
+    vector<std::pair<string, vector<size_t> > > segment_files;
+    size_t next_segment;        // Protected by queue_lock
+    pthread_mutex_t queue_lock;
+};
+
+static void *restore_worker(void *arg)
+{
+    RestorePlan *plan = (RestorePlan *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&plan->queue_lock);
+        if (plan->next_segment >= plan->segment_files.size()) {
+            pthread_mutex_unlock(&plan->queue_lock);
+            return NULL;
+        }
+        size_t job = plan->next_segment++;
+        pthread_mutex_unlock(&plan->queue_lock);
+
+        const vector<size_t> &files = plan->segment_files[job].second;
+        for (size_t i = 0; i < files.size(); i++)
+            restore_file((*plan->entries)[files[i]]);
+    }
+}
+
+/* Load and parse the snapshot descriptor with the given name.  The name may
+ * be given with or without the "snapshot-" prefix and filename extension. */
+static dictionary load_snapshot_descriptor(const string &name)
+{
+    static const char *const snapshot_dirs[] = { "snapshots", "", NULL };
+
+    string basename = name;
+    if (basename.compare(0, 9, "snapshot-") != 0)
+        basename = "snapshot-" + basename;
+    size_t dot = basename.rfind('.');
+    if (dot != string::npos) {
+        string ext = basename.substr(dot);
+        if (ext == ".cumulus" || ext == ".lbs")
+            basename = basename.substr(0, dot);
+    }
+
+    string data;
+    if (!store_load_file(store_root, snapshot_dirs, basename + ".cumulus",
+                         &data)
+        && !store_load_file(store_root, snapshot_dirs, basename + ".lbs",
+                            &data))
+        fatal("Snapshot not found: " + name);
+
+    vector<string> lines;
+    size_t i = 0;
+    while (i < data.size()) {
+        size_t j = data.find('\n', i);
+        if (j == string::npos)
+            j = data.size();
+        lines.push_back(data.substr(i, j - i));
+        i = j + 1;
+    }
+
+    vector<dictionary> stanzas;
+    parse_stanzas(lines, &stanzas);
+    if (stanzas.empty())
+        fatal("Empty snapshot descriptor: " + name);
+    return stanzas[0];
+}
+
+/* Create all leading directories of a path (like mkdir -p). */
+static void make_directories(const string &path)
+{
+    size_t i = 0;
+    while ((i = path.find('/', i + 1)) != string::npos) {
+        string prefix = path.substr(0, i);
+        if (mkdir(prefix.c_str(), 0700) < 0 && errno != EEXIST)
+            fatal("Unable to create directory " + prefix + ": "
+                  + strerror(errno));
+    }
+}
+
+/* Return true if the given path is selected by the path filters given on the
+ * command line (no filters selects everything). */
+static bool path_selected(const string &path, const vector<string> &filters)
+{
+    if (filters.empty())
+        return true;
+    for (size_t i = 0; i < filters.size(); i++) {
+        if (path == filters[i])
+            return true;
+        if (path.size() > filters[i].size()
+            && path.compare(0, filters[i].size(), filters[i]) == 0
+            && path[filters[i].size()] == '/')
+            return true;
+    }
+    return false;
+}
+
+static void usage(const char *program)
+{
+    fprintf(
+        stderr,
+        "Cumulus %s\n\n"
+        "Usage: %s [OPTION]... STORE SNAPSHOT DESTDIR [PATH]...\n"
+        "Restore a snapshot from a local Cumulus storage directory.\n"
+        "\n"
+        "Options:\n"
+        "  --threads=N          number of parallel restore threads\n"
+        "                       (default: 1)\n"
+        "  --decode-filter=EXT:COMMAND\n"
+        "                       decode segment files ending in EXT by piping\n"
+        "                       them through COMMAND (for stores written with\n"
+        "                       a non-default --filter)\n",
+        cumulus_version, program);
+}
+
+int main(int argc, char *argv[])
+{
+    hash_init();
+
+    for (;;) {
+        static struct option long_options[] = {
+            {"threads", 1, 0, 0},           // 0
+            {"decode-filter", 1, 0, 0},     // 1
+            {NULL, 0, 0, 0},
+        };
+
+        int long_index;
+        int c = getopt_long(argc, argv, "", long_options, &long_index);
+
+        if (c == -1)
+            break;
+
+        if (c == 0) {
+            switch (long_index) {
+            case 0:     // --threads
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 1:     // --decode-filter
+                if (!segment_parse_filter_option(optarg)) {
+                    fprintf(stderr, "Invalid decode filter (expected "
+                            "EXT:COMMAND): %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Unhandled long option!\n");
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    store_root = argv[optind];
+    string snapshot_name = argv[optind + 1];
+    dest_dir = argv[optind + 2];
+    vector<string> path_filters;
+    for (int i = optind + 3; i < argc; i++) {
+        string f = sanitize_path(argv[i]);
+        if (!f.empty())
+            path_filters.push_back(f);
+    }
+
+    /* Strip a trailing slash so later concatenation produces clean paths. */
+    while (store_root.size() > 1 && store_root[store_root.size() - 1] == '/')
+        store_root.erase(store_root.size() - 1);
+
+    dictionary descriptor = load_snapshot_descriptor(snapshot_name);
+    string format = get_field(descriptor, "Format");
+    if (format.compare(0, 7, "Cumulus") != 0
+        && format.compare(0, 3, "LBS") != 0)
+        fatal("Unrecognized snapshot format: " + format);
+
+    string root_str = get_field(descriptor, "Root");
+    if (root_str.empty())
+        fatal("Snapshot descriptor has no Root reference");
+    ObjectReference root = ObjectReference::parse(root_str);
+    if (root.is_null())
+        fatal("Invalid Root reference: " + root_str);
+
+    /* Keep enough segments cached that every worker can have a segment of
+     * its own in flight plus a few shared ones for cross-segment block
+     * references. */
+    segment_cache = new SegmentCache(std::max(num_threads * 2, 16));
+
+    /* Phase 1: Read the complete metadata log and build the restore plan. */
+    vector<string> lines;
+    read_metadata_log(root, &lines);
+    vector<dictionary> stanzas;
+    parse_stanzas(lines, &stanzas);
+
+    vector<MetadataEntry> entries;
+    entries.reserve(stanzas.size());
+    for (size_t i = 0; i < stanzas.size(); i++) {
+        MetadataEntry entry;
+        entry.fields = stanzas[i];
+        entry.path = sanitize_path(uri_decode(get_field(stanzas[i], "name")));
+        string type = get_field(stanzas[i], "type");
+        entry.type = type.empty() ? '?' : type[0];
+
+        if (entry.path.empty() || !path_selected(entry.path, path_filters))
+            continue;
+
+        if (entry.type == '-' || entry.type == 'f')
+            parse_data_refs(get_field(stanzas[i], "data"), &entry.data);
+
+        entries.push_back(entry);
+    }
+
+    if (mkdir(dest_dir.c_str(), 0700) < 0 && errno != EEXIST)
+        fatal("Unable to create destination directory " + dest_dir + ": "
+              + strerror(errno));
+
+    /* Create the directory structure up front so workers can write files in
+     * any order. */
+    for (size_t i = 0; i < entries.size(); i++) {
+        string destpath = dest_dir + "/" + entries[i].path;
+        if (entries[i].type == 'd') {
+            make_directories(destpath + "/");
+        } else {
+            make_directories(destpath);
+        }
+    }
+
+    /* Group files by the first segment their data references; files with no
+     * segment data (empty or all-zero files) go in a group of their own. */
+    map<string, vector<size_t> > by_segment;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].type != '-' && entries[i].type != 'f')
+            continue;
+        string segment = "";
+        for (list<ObjectReference>::const_iterator j
+                 = entries[i].data.begin();
+             j != entries[i].data.end(); ++j) {
+            if (j->is_normal()) {
+                segment = j->get_segment();
+                break;
+            }
+        }
+        by_segment[segment].push_back(i);
+    }
+
+    RestorePlan plan;
+    plan.entries = &entries;
+    plan.next_segment = 0;
+    pthread_mutex_init(&plan.queue_lock, NULL);
+    for (map<string, vector<size_t> >::const_iterator i = by_segment.begin();
+         i != by_segment.end(); ++i)
+        plan.segment_files.push_back(std::make_pair(i->first, i->second));
+
+    /* Phase 2: Restore file contents with a pool of worker threads. */
+    vector<pthread_t> workers(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&workers[i], NULL, restore_worker, &plan) != 0)
+            fatal("Unable to create restore thread");
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(workers[i], NULL);
+
+    /* Phase 3: Restore special files, then permissions, ownership, and
+     * timestamps.  Processed in reverse order so directory timestamps are not
+     * clobbered by operations on their contents. */
+    for (size_t n = entries.size(); n-- > 0; ) {
+        const MetadataEntry &entry = entries[n];
+        string destpath = dest_dir + "/" + entry.path;
+
+        switch (entry.type) {
+        case '-': case 'f': case 'd':
+            break;
+        case 'l': {
+            string target = uri_decode(get_field(entry.fields, "target"));
+            unlink(destpath.c_str());
+            if (symlink(target.c_str(), destpath.c_str()) < 0) {
+                report_error("Unable to create symlink " + destpath + ": "
+                             + strerror(errno));
+                continue;
+            }
+            break;
+        }
+        case 'p':
+            if (mkfifo(destpath.c_str(), 0600) < 0 && errno != EEXIST) {
+                report_error("Unable to create fifo " + destpath + ": "
+                             + strerror(errno));
+                continue;
+            }
+            break;
+        case 'c': case 'b': {
+            string device = get_field(entry.fields, "device");
+            size_t slash = device.find('/');
+            if (slash == string::npos) {
+                report_error("Invalid device field for " + entry.path);
+                continue;
+            }
+            dev_t dev = makedev(parse_int(device.substr(0, slash)),
+                                parse_int(device.substr(slash + 1)));
+            mode_t mode = (entry.type == 'c') ? S_IFCHR : S_IFBLK;
+            if (mknod(destpath.c_str(), mode | 0600, dev) < 0
+                && errno != EEXIST) {
+                report_error("Unable to create device " + destpath + ": "
+                             + strerror(errno));
+                continue;
+            }
+            break;
+        }
+        case 's':
+            /* Sockets are not restored, matching the Python tools. */
+            continue;
+        default:
+            fprintf(stderr, "Warning: Unknown file type '%c' for %s\n",
+                    entry.type, entry.path.c_str());
+            continue;
+        }
+
+        string user = get_field(entry.fields, "user");
+        string group = get_field(entry.fields, "group");
+        if (!user.empty() && !group.empty()) {
+            if (lchown(destpath.c_str(), decode_user(user),
+                       decode_user(group)) < 0 && errno != EPERM)
+                fprintf(stderr, "Warning: Unable to chown %s: %s\n",
+                        entry.path.c_str(), strerror(errno));
+        }
+
+        if (entry.type != 'l') {
+            string mode = get_field(entry.fields, "mode");
+            if (!mode.empty())
+                chmod(destpath.c_str(), parse_int(mode) & 07777);
+
+            string mtime = get_field(entry.fields, "mtime");
+            if (!mtime.empty()) {
+                struct utimbuf times;
+                times.actime = times.modtime = parse_int(mtime);
+                utime(destpath.c_str(), &times);
+            }
+        }
+    }
+
+    if (error_count > 0) {
+        fprintf(stderr, "Restore finished with %d errors\n", error_count);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2008-2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Reading back files and segments from a local storage directory. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <bzlib.h>
+#include <zlib.h>
+
+#include <map>
+#include <string>
+
+#include "segment.h"
+#include "store.h"
+#include "util.h"
+
+using std::map;
+using std::string;
+
+const char *const segment_directories[]
+    = { "segments0", "segments1", "", "segments", NULL };
+
+/* Externally-registered decoding filters: file suffix -> shell command. */
+static map<string, string> extra_filters;
+
+void segment_add_filter(const string &extension, const string &command)
+{
+    extra_filters[extension] = command;
+}
+
+bool segment_parse_filter_option(const char *arg)
+{
+    string s = arg;
+    size_t colon = s.find(':');
+    if (colon == string::npos || colon == 0 || colon == s.size() - 1)
+        return false;
+    segment_add_filter(s.substr(0, colon), s.substr(colon + 1));
+    return true;
+}
+
+/* Read an entire file into a string.  Returns false on error. */
+static bool read_file(const string &path, string *out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    out->clear();
+    char buf[65536];
+    ssize_t res;
+    while ((res = read(fd, buf, sizeof(buf))) != 0) {
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        out->append(buf, res);
+    }
+    close(fd);
+    return true;
+}
+
+/* Decompress gzip/zlib data.  The windowBits setting auto-detects the
+ * container format, matching the deflate settings used on the backup path. */
+static bool decompress_gzip(const string &in, string *out)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+        return false;
+
+    char buf[65536];
+    stream.next_in = (Bytef *)const_cast<char *>(in.data());
+    stream.avail_in = in.size();
+
+    int res;
+    do {
+        stream.next_out = (Bytef *)buf;
+        stream.avail_out = sizeof(buf);
+        res = inflate(&stream, Z_NO_FLUSH);
+        if (res != Z_OK && res != Z_STREAM_END) {
+            inflateEnd(&stream);
+            return false;
+        }
+        out->append(buf, sizeof(buf) - stream.avail_out);
+    } while (res != Z_STREAM_END);
+
+    inflateEnd(&stream);
+    return true;
+}
+
+static bool decompress_bzip2(const string &in, string *out)
+{
+    bz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK)
+        return false;
+
+    char buf[65536];
+    stream.next_in = const_cast<char *>(in.data());
+    stream.avail_in = in.size();
+
+    int res;
+    do {
+        stream.next_out = buf;
+        stream.avail_out = sizeof(buf);
+        res = BZ2_bzDecompress(&stream);
+        if (res != BZ_OK && res != BZ_STREAM_END) {
+            BZ2_bzDecompressEnd(&stream);
+            return false;
+        }
+        out->append(buf, sizeof(buf) - stream.avail_out);
+    } while (res != BZ_STREAM_END);
+
+    BZ2_bzDecompressEnd(&stream);
+    return true;
+}
+
+/* Decode a file by running an external command with the file as its standard
+ * input, collecting the command's standard output.  Returns false if the
+ * command cannot be run or exits with an error. */
+static bool decompress_external(const string &path, const string &command,
+                                string *out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        close(fd);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        dup2(fd, 0);
+        dup2(fds[1], 1);
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+        execlp("/bin/sh", "/bin/sh", "-c", command.c_str(), (char *)NULL);
+        _exit(127);
+    }
+    close(fd);
+    close(fds[1]);
+
+    out->clear();
+    char buf[65536];
+    ssize_t res;
+    bool ok = true;
+    while ((res = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            ok = false;
+            break;
+        }
+        out->append(buf, res);
+    }
+    close(fds[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ok = false;
+    return ok;
+}
+
+bool store_load_file(const string &store_root, const char *const *dirs,
+                     const string &basename, string *out)
+{
+    static const char *const suffixes[] = { "", ".gz", ".bz2", NULL };
+
+    for (int i = 0; dirs[i] != NULL; i++) {
+        for (int j = 0; suffixes[j] != NULL; j++) {
+            string path = store_root;
+            if (dirs[i][0] != '\0')
+                path += string("/") + dirs[i];
+            path += "/" + basename + suffixes[j];
+
+            if (access(path.c_str(), R_OK) != 0)
+                continue;
+
+            string raw;
+            if (!read_file(path, &raw))
+                fatal("Error reading " + path);
+
+            bool ok;
+            out->clear();
+            if (strcmp(suffixes[j], ".gz") == 0)
+                ok = decompress_gzip(raw, out);
+            else if (strcmp(suffixes[j], ".bz2") == 0)
+                ok = decompress_bzip2(raw, out);
+            else {
+                out->swap(raw);
+                ok = true;
+            }
+            if (!ok)
+                fatal("Error decompressing " + path);
+            return true;
+        }
+
+        for (map<string, string>::const_iterator f = extra_filters.begin();
+             f != extra_filters.end(); ++f) {
+            string path = store_root;
+            if (dirs[i][0] != '\0')
+                path += string("/") + dirs[i];
+            path += "/" + basename + f->first;
+
+            if (access(path.c_str(), R_OK) != 0)
+                continue;
+
+            out->clear();
+            if (!decompress_external(path, f->second, out))
+                fatal("Error decompressing " + path);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Parse the contents of a segment TAR file into its objects.  Object names
+ * within the segment are of the form "<segment-uuid>/<sequence>"; the map is
+ * keyed by the sequence part. */
+static void parse_segment(const string &segment, const string &data,
+                          map<string, string> *objects)
+{
+    size_t offset = 0;
+
+    while (offset + TAR_BLOCK_SIZE <= data.size()) {
+        const struct tar_header *header
+            = (const struct tar_header *)(data.data() + offset);
+
+        /* An all-zero block marks the end of the archive. */
+        if (header->name[0] == '\0')
+            break;
+
+        char namebuf[sizeof(header->name) + 1];
+        memcpy(namebuf, header->name, sizeof(header->name));
+        namebuf[sizeof(header->name)] = '\0';
+        string name = namebuf;
+
+        char sizebuf[sizeof(header->size) + 1];
+        memcpy(sizebuf, header->size, sizeof(header->size));
+        sizebuf[sizeof(header->size)] = '\0';
+        size_t size = strtoull(sizebuf, NULL, 8);
+
+        offset += TAR_BLOCK_SIZE;
+        if (offset + size > data.size())
+            fatal("Truncated segment: " + segment);
+
+        if (header->typeflag == '0' || header->typeflag == '\0') {
+            size_t slash = name.find('/');
+            if (slash != string::npos && name.compare(0, slash, segment) == 0)
+                (*objects)[name.substr(slash + 1)]
+                    = data.substr(offset, size);
+        }
+
+        size_t blocks = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+        offset += blocks * TAR_BLOCK_SIZE;
+    }
+}
+
+bool segment_load(const string &store_root, const string &segment,
+                  map<string, string> *objects)
+{
+    string data;
+    if (!store_load_file(store_root, segment_directories,
+                         segment + ".tar", &data))
+        return false;
+    parse_segment(segment, data, objects);
+    return true;
+}
@@ -0,0 +1,64 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2008-2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Reading back files from a local Cumulus storage directory: locating a file
+ * among the standard directory layouts, decompressing it, and splitting
+ * segment TAR files into their objects.  Shared by the tools which consume an
+ * existing store (cumulus-restore, cumulus-repack).  Only local storage is
+ * handled; the gzip/bzip2 segment filters are decoded natively, and other
+ * filters (encryption, dictionary compressors, ...) can be registered as
+ * external commands with segment_add_filter. */
+
+#ifndef _LBS_SEGMENT_H
+#define _LBS_SEGMENT_H
+
+#include <map>
+#include <string>
+
+/* The directories which may hold segment files, in search order, covering
+ * both the current layout and older flat stores. */
+extern const char *const segment_directories[];
+
+/* Register an external decoding filter: files with the given suffix (for
+ * example ".zst") are decoded by piping them through the given shell command,
+ * which must read the stored data on standard input and write the decoded
+ * data to standard output.  This is the read-side counterpart of writing
+ * segments with a non-default --filter. */
+void segment_add_filter(const std::string &extension,
+                        const std::string &command);
+
+/* Parse an "EXT:COMMAND" argument (as given to the tools' --decode-filter
+ * option) and register it with segment_add_filter.  Returns false if the
+ * argument is malformed. */
+bool segment_parse_filter_option(const char *arg);
+
+/* Search the store for a file with the given basename, trying each directory
+ * prefix and compression suffix ("", ".gz", ".bz2", and any registered
+ * filter suffixes) in turn.  On success the decompressed contents are
+ * returned in *out. */
+bool store_load_file(const std::string &store_root, const char *const *dirs,
+                     const std::string &basename, std::string *out);
+
+/* Load a segment from the store and parse its TAR contents into the contained
+ * objects, keyed by the sequence part of the object name.  Returns false if
+ * the segment file cannot be found; dies if it is found but corrupt. */
+bool segment_load(const std::string &store_root, const std::string &segment,
+                  std::map<std::string, std::string> *objects);
+
+#endif // _LBS_SEGMENT_H
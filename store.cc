@@ -28,11 +28,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <time.h>
 
+#include <bzlib.h>
+#include <zlib.h>
+
 #include <algorithm>
 #include <list>
 #include <map>
@@ -42,6 +47,7 @@
 
 #include "hash.h"
 #include "localdb.h"
+#include "metrics.h"
 #include "store.h"
 #include "ref.h"
 #include "util.h"
@@ -57,18 +63,50 @@ using std::string;
 const char *filter_program = "bzip2 -c";
 const char *filter_extension = ".bz2";
 
-Tarfile::Tarfile(RemoteFile *file, const string &segment)
+/* Per-group overrides of the segment filter: group -> (program, extension).
+ * Set up from the --group-filter option before any segments are written. */
+static map<string, pair<string, string> > group_filters;
+
+void set_group_filter(const string &group, const string &program,
+                      const string &extension)
+{
+    group_filters[group] = std::make_pair(program, extension);
+}
+
+Tarfile::Tarfile(RemoteFile *file, const string &segment, const char *program)
     : size(0),
-      segment_name(segment)
+      segment_name(segment),
+      queued_size(0),
+      pending_bytes(0),
+      writer_terminate(false)
 {
     assert(sizeof(struct tar_header) == TAR_BLOCK_SIZE);
 
     this->file = file;
-    this->filter.reset(FileFilter::New(file->get_fd(), filter_program));
+    this->filter.reset(FileFilter::New(file->get_fd(),
+                                       program != NULL ? program
+                                                       : filter_program));
+
+    pthread_mutex_init(&queue_lock, NULL);
+    pthread_cond_init(&queue_cond, NULL);
+    if (pthread_create(&writer, NULL, Tarfile::start_writer_thread,
+                       (void *)this) != 0)
+        fatal("Unable to create segment writer thread");
 }
 
 Tarfile::~Tarfile()
 {
+    /* Wait for the writer thread to drain any queued objects. */
+    pthread_mutex_lock(&queue_lock);
+    writer_terminate = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    if (pthread_join(writer, NULL) != 0)
+        fatal("Unable to join segment writer thread");
+
+    pthread_cond_destroy(&queue_cond);
+    pthread_mutex_destroy(&queue_lock);
+
     char buf[TAR_BLOCK_SIZE];
 
     /* Append the EOF marker: two blocks filled with nulls. */
@@ -85,8 +123,62 @@ Tarfile::~Tarfile()
     }
 }
 
+/* Queue an object to be appended to the segment.  The tar formatting and the
+ * write into the (compressing) filter happen on the segment's writer thread;
+ * the data is copied, so the caller's buffer need not remain valid. */
+void Tarfile::write_object(int id, const char *data, size_t len)
+{
+    pending_object obj;
+    obj.id = id;
+    obj.data.assign(data, len);
+
+    size_t blocks = (len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+
+    pthread_mutex_lock(&queue_lock);
+    /* Apply backpressure if the writer thread has fallen well behind, so the
+     * amount of buffered object data stays bounded. */
+    if (pending_bytes >= MAX_PENDING_BYTES) {
+        MetricsTimer wait_timer(METRICS_UPLOAD_WAIT);
+        while (pending_bytes >= MAX_PENDING_BYTES)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    write_queue.push_back(obj);
+    queued_size += TAR_BLOCK_SIZE + blocks * TAR_BLOCK_SIZE;
+    pending_bytes += len;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void *Tarfile::start_writer_thread(void *arg)
+{
+    Tarfile *tarfile = static_cast<Tarfile *>(arg);
+    tarfile->writer_thread();
+    return NULL;
+}
+
+void Tarfile::writer_thread()
+{
+    while (true) {
+        pthread_mutex_lock(&queue_lock);
+        while (write_queue.empty() && !writer_terminate)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (write_queue.empty() && writer_terminate) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        pending_object obj = write_queue.front();
+        write_queue.pop_front();
+        pending_bytes -= obj.data.size();
+        pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+
+        write_object_internal(obj.id, obj.data.data(), obj.data.size());
+    }
+}
+
 FileFilter::FileFilter(int raw, int wrapped, pid_t pid)
-    : fd_raw(raw), fd_wrapped(wrapped), pid(pid) { }
+    : fd_raw(raw), fd_wrapped(wrapped), pid(pid),
+      compressor(COMPRESSOR_NONE), fd_pipe(-1), compressor_error(false) { }
 
 FileFilter *FileFilter::New(int fd, const char *program)
 {
@@ -94,6 +186,29 @@ FileFilter *FileFilter::New(int fd, const char *program)
         return new FileFilter(fd, fd, -1);
     }
 
+    /* If the filter program is one of the standard compressors, skip the
+     * fork/exec and pipe the data through an in-process compression thread
+     * instead.  The compressed output is identical to what the external
+     * program would have produced, so snapshots remain readable by the
+     * restore tools either way. */
+    CompressorType type = match_compressor(program);
+    if (type != COMPRESSOR_NONE) {
+        int fds[2];
+        if (pipe(fds) < 0)
+            fatal("Unable to create pipe for compressor");
+        cloexec(fds[0]);
+        cloexec(fds[1]);
+
+        FileFilter *filter = new FileFilter(fd, fds[1], -1);
+        filter->compressor = type;
+        filter->fd_pipe = fds[0];
+        if (pthread_create(&filter->thread, NULL,
+                           FileFilter::start_compressor_thread,
+                           (void *)filter) != 0)
+            fatal("Unable to create compression thread");
+        return filter;
+    }
+
     pid_t pid;
     int wrapped_fd = spawn_filter(fd, program, &pid);
     return new FileFilter(fd, wrapped_fd, pid);
@@ -101,6 +216,21 @@ FileFilter *FileFilter::New(int fd, const char *program)
 
 int FileFilter::wait()
 {
+    // An in-process compressor finishes once its thread has consumed all data
+    // from the pipe and exited.
+    if (compressor != COMPRESSOR_NONE) {
+        if (pthread_join(thread, NULL) != 0) {
+            fprintf(stderr, "Error joining compression thread: %m\n");
+            return -1;
+        }
+        close(fd_raw);
+        if (compressor_error) {
+            fprintf(stderr, "Compression thread error\n");
+            return -1;
+        }
+        return 0;
+    }
+
     // No filter program was launched implies no need to wait.
     if (pid == -1)
         return 0;
@@ -122,6 +252,148 @@ int FileFilter::wait()
     return status;
 }
 
+FileFilter::CompressorType FileFilter::match_compressor(const char *program)
+{
+    if (strcmp(program, "bzip2") == 0 || strcmp(program, "bzip2 -c") == 0)
+        return COMPRESSOR_BZIP2;
+    if (strcmp(program, "gzip") == 0 || strcmp(program, "gzip -c") == 0)
+        return COMPRESSOR_GZIP;
+    return COMPRESSOR_NONE;
+}
+
+void *FileFilter::start_compressor_thread(void *arg)
+{
+    FileFilter *filter = static_cast<FileFilter *>(arg);
+    filter->compressor_thread();
+    return NULL;
+}
+
+/* Write an entire buffer to a file descriptor, retrying on interruption and
+ * short writes. */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Write error: %m\n");
+            return false;
+        }
+        buf += res;
+        len -= (size_t)res;
+    }
+    return true;
+}
+
+/* In-process replacement for an external compression filter.  Data written to
+ * the wrapped file descriptor arrives on fd_pipe; it is compressed and
+ * written to fd_raw.  The thread exits when the write side of the pipe is
+ * closed and all pending output has been flushed. */
+void FileFilter::compressor_thread()
+{
+    const size_t BUF_SIZE = 1 << 16;
+    char *inbuf = new char[BUF_SIZE];
+    char *outbuf = new char[BUF_SIZE];
+
+    bz_stream bzstrm;
+    z_stream zstrm;
+    memset(&bzstrm, 0, sizeof(bzstrm));
+    memset(&zstrm, 0, sizeof(zstrm));
+
+    if (compressor == COMPRESSOR_BZIP2) {
+        /* Block size 9 matches the bzip2 command-line default. */
+        if (BZ2_bzCompressInit(&bzstrm, 9, 0, 0) != BZ_OK)
+            fatal("BZ2_bzCompressInit");
+    } else {
+        /* windowBits of 15+16 selects the gzip container format. */
+        if (deflateInit2(&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+            fatal("deflateInit2");
+    }
+
+    bool input_done = false;
+    while (!input_done && !compressor_error) {
+        ssize_t n = read(fd_pipe, inbuf, BUF_SIZE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error reading from compression pipe: %m\n");
+            compressor_error = true;
+            break;
+        }
+        if (n == 0)
+            input_done = true;
+
+        MetricsTimer compress_timer(METRICS_COMPRESS);
+        metrics_add_bytes(METRICS_COMPRESS, n);
+
+        if (compressor == COMPRESSOR_BZIP2) {
+            bzstrm.next_in = inbuf;
+            bzstrm.avail_in = (unsigned)n;
+            int action = input_done ? BZ_FINISH : BZ_RUN;
+            while (true) {
+                bzstrm.next_out = outbuf;
+                bzstrm.avail_out = BUF_SIZE;
+                int rc = BZ2_bzCompress(&bzstrm, action);
+                if (rc != BZ_RUN_OK && rc != BZ_FINISH_OK
+                    && rc != BZ_STREAM_END) {
+                    fprintf(stderr, "BZ2_bzCompress error: %d\n", rc);
+                    compressor_error = true;
+                    break;
+                }
+                if (!write_all(fd_raw, outbuf, BUF_SIZE - bzstrm.avail_out)) {
+                    compressor_error = true;
+                    break;
+                }
+                if (rc == BZ_STREAM_END)
+                    break;
+                if (action == BZ_RUN && bzstrm.avail_in == 0)
+                    break;
+            }
+        } else {
+            zstrm.next_in = (Bytef *)inbuf;
+            zstrm.avail_in = (uInt)n;
+            int flush = input_done ? Z_FINISH : Z_NO_FLUSH;
+            while (true) {
+                zstrm.next_out = (Bytef *)outbuf;
+                zstrm.avail_out = BUF_SIZE;
+                int rc = deflate(&zstrm, flush);
+                if (rc != Z_OK && rc != Z_STREAM_END) {
+                    fprintf(stderr, "deflate error: %d\n", rc);
+                    compressor_error = true;
+                    break;
+                }
+                if (!write_all(fd_raw, outbuf, BUF_SIZE - zstrm.avail_out)) {
+                    compressor_error = true;
+                    break;
+                }
+                if (rc == Z_STREAM_END)
+                    break;
+                if (flush == Z_NO_FLUSH && zstrm.avail_in == 0)
+                    break;
+            }
+        }
+    }
+
+    if (compressor == COMPRESSOR_BZIP2)
+        BZ2_bzCompressEnd(&bzstrm);
+    else
+        deflateEnd(&zstrm);
+
+    /* On error, keep draining the pipe until the writer closes it so that the
+     * main thread does not block writing to a full pipe. */
+    while (!input_done) {
+        ssize_t n = read(fd_pipe, inbuf, BUF_SIZE);
+        if (n == 0 || (n < 0 && errno != EINTR))
+            input_done = true;
+    }
+
+    close(fd_pipe);
+    delete[] inbuf;
+    delete[] outbuf;
+}
+
 /* Launch a child process which can act as a filter (compress, encrypt, etc.)
  * on the TAR output.  The file descriptor to which output should be written
  * must be specified; the return value is the file descriptor which will be
@@ -173,10 +445,22 @@ int FileFilter::spawn_filter(int fd_out, const char *program, pid_t *filter_pid)
 
 void Tarfile::tar_write(const char *data, size_t len)
 {
-    size += len;
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = len;
+    tar_writev(&iov, 1);
+}
 
-    while (len > 0) {
-        int res = write(filter->get_wrapped_fd(), data, len);
+/* Write a sequence of buffers to the tar file with scatter/gather I/O, so an
+ * object (header, data, and padding) reaches the filter pipe in a single
+ * writev call without first being assembled in an intermediate buffer. */
+void Tarfile::tar_writev(struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+        ssize_t res = writev(filter->get_wrapped_fd(), iov, iovcnt);
 
         if (res < 0) {
             if (errno == EINTR)
@@ -185,12 +469,20 @@ void Tarfile::tar_write(const char *data, size_t len)
             fatal("Write error");
         }
 
-        len -= res;
-        data += res;
+        /* Skip over the buffers (and any partial buffer) already written. */
+        while (iovcnt > 0 && (size_t)res >= iov[0].iov_len) {
+            res -= iov[0].iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov[0].iov_base = (char *)iov[0].iov_base + res;
+            iov[0].iov_len -= res;
+        }
     }
 }
 
-void Tarfile::write_object(int id, const char *data, size_t len)
+void Tarfile::write_object_internal(int id, const char *data, size_t len)
 {
     struct tar_header header;
     memset(&header, 0, sizeof(header));
@@ -218,18 +510,29 @@ void Tarfile::write_object(int id, const char *data, size_t len)
     }
     sprintf(header.chksum, "%06o", checksum);
 
-    tar_write((const char *)&header, TAR_BLOCK_SIZE);
-
-    if (len == 0)
-        return;
-
-    tar_write(data, len);
-
-    char padbuf[TAR_BLOCK_SIZE];
+    /* Send the header, object data, and padding out to the tar block
+     * boundary with a single gathered write: the object data goes straight
+     * from the caller's buffer to the filter without intermediate copies. */
+    static const char padbuf[TAR_BLOCK_SIZE] = { 0, };
     size_t blocks = (len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
     size_t padding = blocks * TAR_BLOCK_SIZE - len;
-    memset(padbuf, 0, padding);
-    tar_write(padbuf, padding);
+
+    struct iovec iov[3];
+    int iovcnt = 1;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = TAR_BLOCK_SIZE;
+    if (len > 0) {
+        iov[1].iov_base = const_cast<char *>(data);
+        iov[1].iov_len = len;
+        iovcnt = 2;
+        if (padding > 0) {
+            iov[2].iov_base = const_cast<char *>(padbuf);
+            iov[2].iov_len = padding;
+            iovcnt = 3;
+        }
+    }
+
+    tar_writev(iov, iovcnt);
 }
 
 /* Estimate the size based on the size of the actual output file on disk.
@@ -244,18 +547,127 @@ size_t Tarfile::size_estimate()
 {
     struct stat statbuf;
 
+    /* Use the number of bytes queued for the writer thread rather than the
+     * bytes it has written so far: queued objects will reach the file
+     * eventually, and counting them keeps the segment size target accurate
+     * even when the writer is running behind. */
+    pthread_mutex_lock(&queue_lock);
+    size_t input_size = queued_size;
+    pthread_mutex_unlock(&queue_lock);
+
     if (fstat(filter->get_raw_fd(), &statbuf) == 0)
-        return max((int64_t)statbuf.st_size, (int64_t)(size / 128));
+        return max((int64_t)statbuf.st_size, (int64_t)(input_size / 128));
 
     /* Couldn't stat the file on disk, so just return the actual number of
      * bytes, before compression. */
-    return size;
+    return input_size;
 }
 
-static const size_t SEGMENT_SIZE = 4 * 1024 * 1024;
+/* Initial per-group segment size target; doubled as segments in a group fill
+ * up, until segment_size_limit is reached. */
+static const size_t INITIAL_SEGMENT_SIZE = 4 * 1024 * 1024;
+
+size_t segment_size_limit = 4 * 1024 * 1024;
 
-/* Backup size summary: segment type -> (uncompressed size, compressed size) */
+/* Backup size summary: segment type -> (uncompressed size, compressed size).
+ * Updated from both the main thread and the segment finalizer thread, so
+ * access is serialized with a lock. */
 static map<string, pair<int64_t, int64_t> > group_sizes;
+static pthread_mutex_t group_sizes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+TarSegmentStore::TarSegmentStore(RemoteStore *remote, LocalDb *db)
+{
+    this->remote = remote;
+    this->db = db;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    finalizing = 0;
+    terminate = false;
+    if (pthread_create(&finalizer, NULL, TarSegmentStore::start_finalizer_thread,
+                       (void *)this) != 0)
+        fatal("Unable to create segment finalizer thread");
+}
+
+TarSegmentStore::~TarSegmentStore()
+{
+    sync();
+
+    pthread_mutex_lock(&lock);
+    terminate = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    if (pthread_join(finalizer, NULL) != 0)
+        fatal("Unable to join segment finalizer thread");
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void *TarSegmentStore::start_finalizer_thread(void *arg)
+{
+    TarSegmentStore *store = static_cast<TarSegmentStore *>(arg);
+    store->finalizer_thread();
+    return NULL;
+}
+
+/* Background thread which finalizes closed segments: waiting for the
+ * segment's writer thread (and thus compression) to finish, checksumming the
+ * segment file, recording its metadata in the local database, and queueing
+ * the upload.  Doing this here keeps the main backup thread from stalling
+ * each time a segment fills up. */
+void TarSegmentStore::finalizer_thread()
+{
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (finalize_queue.empty() && !terminate)
+            pthread_cond_wait(&cond, &lock);
+        if (finalize_queue.empty() && terminate) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        struct segment_info *segment = finalize_queue.front();
+        finalize_queue.pop_front();
+        finalizing++;
+        pthread_mutex_unlock(&lock);
+
+        finalize_segment(segment);
+
+        pthread_mutex_lock(&lock);
+        finalizing--;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void TarSegmentStore::finalize_segment(struct segment_info *segment)
+{
+    /* Deleting the Tarfile drains its write queue, appends the tar EOF
+     * marker, and waits for the compression filter to finish. */
+    delete segment->file;
+
+    if (db != NULL) {
+        struct stat stat_buf;
+        int disk_size = 0;
+        if (stat(segment->rf->get_local_path().c_str(), &stat_buf) == 0) {
+            disk_size = stat_buf.st_size;
+            pthread_mutex_lock(&group_sizes_lock);
+            group_sizes[segment->group].second += disk_size;
+            pthread_mutex_unlock(&group_sizes_lock);
+        }
+
+        string checksum
+            = Hash::hash_file(segment->rf->get_local_path().c_str());
+
+        db->SetSegmentMetadata(segment->name, segment->rf->get_remote_path(),
+                               checksum, segment->group, segment->data_size,
+                               disk_size);
+    }
+
+    segment->rf->send();
+
+    delete segment;
+}
 
 ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
                                               const std::string &group,
@@ -271,14 +683,27 @@ ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
 
         segment->name = generate_uuid();
         segment->group = group;
+        if (group_targets.find(group) == group_targets.end())
+            group_targets[group] = std::min(INITIAL_SEGMENT_SIZE,
+                                            segment_size_limit);
+        segment->size_target = group_targets[group];
+        const char *program = NULL;
+        const char *extension = filter_extension;
+        map<string, pair<string, string> >::const_iterator f
+            = group_filters.find(group);
+        if (f != group_filters.end()) {
+            program = f->second.first.c_str();
+            extension = f->second.second.c_str();
+        }
+
         segment->basename = segment->name + ".tar";
-        segment->basename += filter_extension;
+        segment->basename += extension;
         segment->count = 0;
         segment->data_size = 0;
         segment->rf = remote->alloc_file(segment->basename,
                                          group == "metadata" ? "segments0"
                                                              : "segments1");
-        segment->file = new Tarfile(segment->rf, segment->name);
+        segment->file = new Tarfile(segment->rf, segment->name, program);
 
         segments[group] = segment;
     } else {
@@ -293,7 +718,9 @@ ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
     segment->count++;
     segment->data_size += len;
 
+    pthread_mutex_lock(&group_sizes_lock);
     group_sizes[group].first += len;
+    pthread_mutex_unlock(&group_sizes_lock);
 
     ObjectReference ref(segment->name, id_buf);
     ref.set_range(0, len, true);
@@ -303,9 +730,13 @@ ObjectReference TarSegmentStore::write_object(const char *data, size_t len,
         db->StoreObject(ref, age);
 
     // If this segment meets or exceeds the size target, close it so that
-    // future objects will go into a new segment.
-    if (segment->file->size_estimate() >= SEGMENT_SIZE)
+    // future objects will go into a new segment.  The next segment in the
+    // group gets a doubled target, up to the configured limit.
+    if (segment->file->size_estimate() >= segment->size_target) {
+        group_targets[group] = std::min(segment->size_target * 2,
+                                        segment_size_limit);
         close_segment(group);
+    }
 
     return ref;
 }
@@ -314,43 +745,37 @@ void TarSegmentStore::sync()
 {
     while (!segments.empty())
         close_segment(segments.begin()->first);
+
+    /* Wait for the finalizer thread to drain its queue. */
+    pthread_mutex_lock(&lock);
+    while (!finalize_queue.empty() || finalizing > 0)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
 }
 
 void TarSegmentStore::dump_stats()
 {
     printf("Data written:\n");
+    pthread_mutex_lock(&group_sizes_lock);
     for (map<string, pair<int64_t, int64_t> >::iterator i = group_sizes.begin();
          i != group_sizes.end(); ++i) {
         printf("    %s: %lld (%lld compressed)\n", i->first.c_str(),
                (long long)i->second.first, (long long)i->second.second);
     }
+    pthread_mutex_unlock(&group_sizes_lock);
 }
 
+/* Hand a filled segment to the finalizer thread.  The segment's writer thread
+ * may still be compressing queued objects; the finalizer will wait for it. */
 void TarSegmentStore::close_segment(const string &group)
 {
     struct segment_info *segment = segments[group];
-
-    delete segment->file;
-
-    if (db != NULL) {
-        struct stat stat_buf;
-        int disk_size = 0;
-        if (stat(segment->rf->get_local_path().c_str(), &stat_buf) == 0) {
-            disk_size = stat_buf.st_size;
-            group_sizes[segment->group].second += disk_size;
-        }
-
-        string checksum
-            = Hash::hash_file(segment->rf->get_local_path().c_str());
-
-        db->SetSegmentMetadata(segment->name, segment->rf->get_remote_path(),
-                               checksum, group, segment->data_size, disk_size);
-    }
-
-    segment->rf->send();
-
     segments.erase(segments.find(group));
-    delete segment;
+
+    pthread_mutex_lock(&lock);
+    finalize_queue.push_back(segment);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
 }
 
 string TarSegmentStore::object_reference_to_segment(const string &object)
@@ -24,12 +24,17 @@
 #ifndef _LBS_STORE_H
 #define _LBS_STORE_H
 
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
+#include <algorithm>
 #include <list>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 #include <iostream>
 #include <sstream>
 
@@ -42,8 +47,49 @@
 class LbsObject;
 
 /* In memory datatype to represent key/value pairs of information, such as file
- * metadata.  Currently implemented as map<string, string>. */
-typedef std::map<std::string, std::string> dictionary;
+ * metadata.  This was once a std::map, but a map costs a node allocation per
+ * key and one is built for every inode dumped; instead store the entries in a
+ * flat vector kept sorted by key.  A record only ever holds a dozen or so
+ * keys, so the sorted insert is cheap, and iteration visits the keys in the
+ * same order the map did (the metadata log format is unchanged). */
+class dictionary {
+public:
+    typedef std::pair<std::string, std::string> value_type;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    const_iterator find(const std::string &key) const {
+        const_iterator i = std::lower_bound(entries.begin(), entries.end(),
+                                            key, key_less);
+        return (i != entries.end() && i->first == key) ? i : entries.end();
+    }
+
+    /* Return the value for the given key, inserting an empty value (at the
+     * proper position to keep the entries sorted) if the key is new. */
+    std::string &operator[](const std::string &key) {
+        std::vector<value_type>::iterator i
+            = std::lower_bound(entries.begin(), entries.end(), key, key_less);
+        if (i == entries.end() || i->first != key)
+            i = entries.insert(i, value_type(key, std::string()));
+        return i->second;
+    }
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    void clear() { entries.clear(); }
+
+    bool operator==(const dictionary &other) const {
+        return entries == other.entries;
+    }
+
+private:
+    static bool key_less(const value_type &entry, const std::string &key) {
+        return entry.first < key;
+    }
+
+    std::vector<value_type> entries;
+};
 
 /* Simplified TAR header--we only need to store regular files, don't need to
  * handle long filenames, etc. */
@@ -83,6 +129,16 @@ public:
     int get_wrapped_fd() const { return fd_wrapped; }
 
 private:
+    // Compression algorithms implemented in-process.  Filter programs naming
+    // a known compressor ("bzip2 -c", "gzip -c") are run as a compression
+    // thread inside cumulus rather than as a child process; any other
+    // program (for example an encryption command) is still fork/exec'ed.
+    enum CompressorType {
+        COMPRESSOR_NONE,        // Not a recognized compressor: fork/exec
+        COMPRESSOR_BZIP2,
+        COMPRESSOR_GZIP,
+    };
+
     FileFilter(int raw, int wrapped, pid_t pid);
 
     // Launch a process to filter data written to a file descriptor.  fd_out is
@@ -93,6 +149,15 @@ private:
     // process is stored at address filter_pid if non-NULL.
     static int spawn_filter(int fd_out, const char *program, pid_t *filter_pid);
 
+    // Determine whether the given filter program can be replaced by an
+    // in-process compressor.
+    static CompressorType match_compressor(const char *program);
+
+    // Body of the in-process compression thread: reads data from the pipe at
+    // fd_pipe and writes the compressed stream to fd_raw.
+    void compressor_thread();
+    static void *start_compressor_thread(void *arg);
+
     // The original file descriptor passed when creating the FileFilter object.
     int fd_raw;
 
@@ -103,14 +168,27 @@ private:
     // The filter process if one was launched, or -1 if there is no filter
     // program.
     pid_t pid;
+
+    // State for in-process compression, when used instead of a filter
+    // process.
+    CompressorType compressor;
+    pthread_t thread;
+    int fd_pipe;                // Read end of the pipe feeding the compressor
+    bool compressor_error;      // Set if the compression thread failed
 };
 
 /* A simple wrapper around a single TAR file to represent a segment.  Objects
  * may only be written out all at once, since the tar header must be written
- * first; incremental writing is not supported. */
+ * first; incremental writing is not supported.
+ *
+ * Each Tarfile runs a writer thread of its own: write_object queues a copy of
+ * the object data and returns immediately, and the thread performs the actual
+ * tar formatting and the (possibly compressing) write.  This overlaps
+ * compression with reading files on the main backup thread. */
 class Tarfile {
 public:
-    Tarfile(RemoteFile *file, const std::string &segment);
+    Tarfile(RemoteFile *file, const std::string &segment,
+            const char *program = NULL);    // NULL: use filter_program
     ~Tarfile();
 
     void write_object(int id, const char *data, size_t len);
@@ -119,23 +197,47 @@ public:
     size_t size_estimate();
 
 private:
+    // Maximum bytes of object data buffered for the writer thread before
+    // write_object blocks.
+    static const size_t MAX_PENDING_BYTES = 4 * 1024 * 1024;
+
+    struct pending_object {
+        int id;
+        std::string data;
+    };
+
     size_t size;
     std::string segment_name;
 
     RemoteFile *file;
     scoped_ptr<FileFilter> filter;
 
+    // Objects queued for the writer thread, and the number of uncompressed
+    // bytes (including tar headers and padding) queued so far.
+    pthread_t writer;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    std::list<pending_object> write_queue;
+    size_t queued_size;
+    size_t pending_bytes;       // Bytes queued but not yet written
+    bool writer_terminate;
+
+    void writer_thread();
+    static void *start_writer_thread(void *arg);
+
+    // Format and write a single object; runs on the writer thread.
+    void write_object_internal(int id, const char *data, size_t len);
+
     // Write data to the tar file
     void tar_write(const char *data, size_t size);
+    void tar_writev(struct iovec *iov, int iovcnt);
 };
 
 class TarSegmentStore {
 public:
     // New segments will be stored in the given directory.
-    TarSegmentStore(RemoteStore *remote,
-                    LocalDb *db = NULL)
-        { this->remote = remote; this->db = db; }
-    ~TarSegmentStore() { sync(); }
+    TarSegmentStore(RemoteStore *remote, LocalDb *db = NULL);
+    ~TarSegmentStore();
 
     // Writes an object to segment in the store, and returns the name
     // (segment/object) to refer to it.  The optional parameter group can be
@@ -159,6 +261,7 @@ private:
         std::string name;           // UUID
         int count;                  // Objects written to this segment
         int data_size;              // Combined size of objects written
+        size_t size_target;         // Close the segment at this size
         std::string basename;       // Name of segment without directory
         RemoteFile *rf;
     };
@@ -167,6 +270,27 @@ private:
     std::map<std::string, struct segment_info *> segments;
     LocalDb *db;
 
+    // Per-group segment size targets.  Each group starts with small segments
+    // and doubles the target as segments fill, up to the configured maximum,
+    // so small backups (and low-volume groups such as metadata) produce
+    // small segments while bulk data converges on large ones.
+    std::map<std::string, size_t> group_targets;
+
+    // Closed segments are finalized (writer thread joined, segment
+    // checksummed, metadata recorded, upload queued) on a background thread
+    // so the main backup thread is not stalled waiting for compression to
+    // complete.
+    pthread_t finalizer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::list<struct segment_info *> finalize_queue;
+    int finalizing;             // Segments currently being finalized
+    bool terminate;
+
+    void finalizer_thread();
+    static void *start_finalizer_thread(void *arg);
+    void finalize_segment(struct segment_info *segment);
+
     // Ensure that all segments in the given group have been fully written.
     void close_segment(const std::string &group);
 
@@ -229,4 +353,18 @@ extern const char *filter_program;
  * included; this adds to it) */
 extern const char *filter_extension;
 
+/* Override the segment filter for one object group.  Groups with highly
+ * repetitive contents (the metadata log especially) can be routed through a
+ * different compressor than bulk data--for example one using a trained
+ * dictionary--while other groups keep the default filter.  The extension is
+ * appended to segment filenames in place of filter_extension; reading such
+ * segments back requires registering a matching decoder with
+ * segment_add_filter (or the Python tools' equivalent). */
+void set_group_filter(const std::string &group, const std::string &program,
+                      const std::string &extension);
+
+/* Maximum (compressed) size of a segment; segments are closed once they grow
+ * to this size.  Settable with the --segment-size option. */
+extern size_t segment_size_limit;
+
 #endif // _LBS_STORE_H
@@ -27,6 +27,7 @@
 #include <arpa/inet.h>
 
 #include "hash.h"
+#include "metrics.h"
 #include "subfile.h"
 #include "third_party/chunk.h"
 
@@ -152,6 +153,8 @@ void Subfile::analyze_new_block(const char *buf, size_t len)
     free_analysis();
 
     size_t *breakpoints = new size_t[max_chunks];
+    MetricsTimer chunk_timer(METRICS_CHUNK);
+    metrics_add_bytes(METRICS_CHUNK, len);
     int num_breakpoints = chunk_compute_breaks(buf, len, breakpoints);
 
     if (num_breakpoints == 0) {
@@ -245,12 +248,24 @@ list<ObjectReference> Subfile::create_incremental(TarSegmentStore *tss,
 
         struct subfile_item item;
         if (m == chunk_index.end()) {
-            item.type = SUBFILE_NEW;
-            item.src_offset = new_block_summary.chunks[i].offset;
-            item.dst_offset = new_data;
-            item.len = new_block_summary.chunks[i].len;
-            item.hash = new_block_summary.chunks[i].hash;
-            new_data += item.len;
+            /* Not a chunk of this file's old contents; check the global chunk
+             * index in case the same data was stored as part of some other
+             * object. */
+            ObjectReference global
+                = db->FindChunk(new_block_summary.chunks[i].hash,
+                                algorithm_name);
+            if (!global.is_null()) {
+                item.type = SUBFILE_COPY;
+                item.ref = global;
+                matched_old = true;
+            } else {
+                item.type = SUBFILE_NEW;
+                item.src_offset = new_block_summary.chunks[i].offset;
+                item.dst_offset = new_data;
+                item.len = new_block_summary.chunks[i].len;
+                item.hash = new_block_summary.chunks[i].hash;
+                new_data += item.len;
+            }
         } else {
             struct chunk_info &old_chunk
                 = block_list[m->second.first].chunks[m->second.second];
@@ -272,9 +272,105 @@ window::window (uint64_t poly)
   bzero (buf, sizeof (buf));
 }
 
+/* Gear/FastCDC-style chunker.  The rolling hash is a single shift and table
+ * lookup per byte (no serial table-driven polynomial arithmetic), and bytes
+ * below the minimum chunk size are skipped entirely, so it runs several
+ * times faster than the Rabin fingerprint above.  Breakpoints are declared
+ * when the high bits of the hash are zero; following FastCDC, a stricter
+ * mask is used before the target chunk size and a looser one after it, to
+ * normalize the chunk size distribution.
+ *
+ * The gear table and masks must never change: chunk signatures computed with
+ * this algorithm are cached in the local database under the algorithm name
+ * below, and must be reproducible on later backups. */
+
+#define GEAR_MASK_STRICT 0x9249249248000000ULL    /* 13 bits set */
+#define GEAR_MASK_LOOSE  0x9249249200000000ULL    /* 11 bits set */
+#define GEAR_WINDOW 64
+
+static uint64_t gear_table[256];
+static bool gear_table_ready = false;
+
+/* Fill in the gear table deterministically (splitmix64 with a fixed seed). */
+static void gear_init()
+{
+    uint64_t state = UINT64_C(0x243f6a8885a308d3);    /* Digits of pi */
+    for (int i = 0; i < 256; i++) {
+        state += UINT64_C(0x9e3779b97f4a7c15);
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        gear_table[i] = z ^ (z >> 31);
+    }
+    gear_table_ready = true;
+}
+
+static int gear_compute_breaks(const char *buf, size_t len,
+                               size_t *breakpoints)
+{
+    if (!gear_table_ready)
+        gear_init();
+
+    int i = 0;
+    size_t start = 0;
+
+    while (start < len) {
+        size_t limit = start + MAX_CHUNK_SIZE;
+        if (limit > len)
+            limit = len;
+
+        /* The minimum chunk size need not be scanned; begin hashing just
+         * far enough back that the rolling hash window is warm once
+         * breakpoint tests start. */
+        size_t first_test = start + MIN_CHUNK_SIZE - 1;
+        size_t pos = (first_test >= GEAR_WINDOW) ? first_test - GEAR_WINDOW
+                                                 : start;
+        size_t target = start + TARGET_CHUNK_SIZE;
+        uint64_t h = 0;
+        size_t breakpos = limit - 1;
+
+        for (; pos < limit; pos++) {
+            h = (h << 1) + gear_table[(uint8_t)buf[pos]];
+            if (pos < first_test)
+                continue;
+            uint64_t mask = (pos < target) ? GEAR_MASK_STRICT
+                                           : GEAR_MASK_LOOSE;
+            if ((h & mask) == 0) {
+                breakpos = pos;
+                break;
+            }
+        }
+
+        breakpoints[i] = breakpos;
+        i++;
+        start = breakpos + 1;
+    }
+
+    return i;
+}
+
 } // end anonymous namespace
 
 /* Public interface to this module. */
+
+/* Which chunking algorithm to use; set with chunk_select_algorithm.  The
+ * default is the gear-based chunker; "lbfs" selects the original Rabin
+ * fingerprint code. */
+static bool use_gear_chunker = true;
+
+bool chunk_select_algorithm(const char *name)
+{
+    if (strcmp(name, "fastcdc") == 0) {
+        use_gear_chunker = true;
+        return true;
+    }
+    if (strcmp(name, "lbfs") == 0) {
+        use_gear_chunker = false;
+        return true;
+    }
+    return false;
+}
+
 int chunk_compute_max_num_breaks(size_t buflen)
 {
     return (buflen / MIN_CHUNK_SIZE) + 1;
@@ -282,6 +378,9 @@ int chunk_compute_max_num_breaks(size_t buflen)
 
 int chunk_compute_breaks(const char *buf, size_t len, size_t *breakpoints)
 {
+    if (use_gear_chunker)
+        return gear_compute_breaks(buf, len, breakpoints);
+
     size_t start, pos;
     window w(FINGERPRINT_PT);
 
@@ -310,6 +409,7 @@ int chunk_compute_breaks(const char *buf, size_t len, size_t *breakpoints)
 string chunk_algorithm_name()
 {
     char buf[64];
-    sprintf(buf, "%s-%d", "lbfs", TARGET_CHUNK_SIZE);
+    sprintf(buf, "%s-%d", use_gear_chunker ? "fastcdc" : "lbfs",
+            TARGET_CHUNK_SIZE);
     return buf;
 }
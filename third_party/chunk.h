@@ -37,4 +37,10 @@ int chunk_compute_max_num_breaks(size_t buflen);
 int chunk_compute_breaks(const char *buf, size_t len, size_t *breakpoints);
 std::string chunk_algorithm_name();
 
+/* Select the chunking algorithm ("fastcdc" or "lbfs") used for new blocks.
+ * Returns false if the name is not recognized.  The algorithm is recorded in
+ * the signature data stored in the local database, so signatures computed
+ * with a different algorithm are simply not reused. */
+bool chunk_select_algorithm(const char *name);
+
 #endif // _LBS_CHUNK_H
@@ -21,6 +21,7 @@
  * later, for parsing them back, perhaps). */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -131,6 +132,46 @@ long long parse_int(const string &s)
     return strtoll(s.c_str(), NULL, 0);
 }
 
+/* Test whether a buffer consists entirely of zero bytes.  After aligning to a
+ * word boundary, the main loop checks 64 bytes per iteration by ORing eight
+ * words together (which the compiler can vectorize), with an early exit as
+ * soon as a nonzero word is seen. */
+bool is_all_zero(const char *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0 && ((uintptr_t)p & (sizeof(uint64_t) - 1)) != 0) {
+        if (*p != 0)
+            return false;
+        p++;
+        len--;
+    }
+
+    const uint64_t *w = (const uint64_t *)p;
+    while (len >= 64) {
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+            return false;
+        w += 8;
+        len -= 64;
+    }
+    while (len >= sizeof(uint64_t)) {
+        if (*w != 0)
+            return false;
+        w++;
+        len -= sizeof(uint64_t);
+    }
+
+    p = (const char *)w;
+    while (len > 0) {
+        if (*p != 0)
+            return false;
+        p++;
+        len--;
+    }
+
+    return true;
+}
+
 /* Mark a file descriptor as close-on-exec. */
 void cloexec(int fd)
 {
@@ -23,6 +23,8 @@
 #ifndef _LBS_FORMAT_H
 #define _LBS_FORMAT_H
 
+#include <stddef.h>
+
 #include <iostream>
 #include <map>
 #include <string>
@@ -30,6 +32,10 @@
 std::string string_printf(const char *fmt, ...)
     __attribute__((format(printf, 1, 2)));
 
+/* Test whether a buffer consists entirely of zero bytes, scanning a word at a
+ * time.  Used for sparse-file detection on every block backed up. */
+bool is_all_zero(const char *buf, size_t len);
+
 std::string uri_encode(const std::string &in);
 std::string uri_decode(const std::string &in);
 std::string encode_int(long long n, int base=10);
@@ -0,0 +1,480 @@
+/* Cumulus: Efficient Filesystem Backup to the Cloud
+ * Copyright (C) 2008-2026 The Cumulus Developers
+ * See the AUTHORS file for a list of contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Native snapshot verification.  Every backup writes a segment-metadata file
+ * alongside the snapshot descriptor which records a checksum for each
+ * segment; this tool re-hashes the stored segment files against those
+ * checksums with a pool of worker threads, so a snapshot can be verified in
+ * a small fraction of the time a trial restore would take.  Optionally the
+ * object-level structure of each segment (tar headers and sizes) is checked
+ * as well.  Only local (filesystem) storage is handled, like
+ * cumulus-restore. */
+
+#include <ctype.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "segment.h"
+#include "store.h"
+#include "util.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+#ifndef CUMULUS_VERSION
+#define CUMULUS_VERSION Unknown
+#endif
+#define CUMULUS_STRINGIFY(s) CUMULUS_STRINGIFY2(s)
+#define CUMULUS_STRINGIFY2(s) #s
+static const char cumulus_version[] = CUMULUS_STRINGIFY(CUMULUS_VERSION);
+
+static int num_threads = 1;
+static bool check_objects = false;
+
+/* The root of the storage directory holding the snapshot. */
+static string store_root;
+
+/* Count of verification failures (missing files, checksum mismatches, bad
+ * structure); reported at the end and reflected in the exit status. */
+static int error_count = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report_error(const string &msg)
+{
+    pthread_mutex_lock(&error_lock);
+    error_count++;
+    pthread_mutex_unlock(&error_lock);
+
+    pthread_mutex_lock(&print_lock);
+    fprintf(stderr, "%s\n", msg.c_str());
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Split text data into lines (without the newline terminators). */
+static void split_lines(const string &data, vector<string> *lines)
+{
+    size_t i = 0;
+    while (i < data.size()) {
+        size_t j = data.find('\n', i);
+        if (j == string::npos)
+            j = data.size();
+        lines->push_back(data.substr(i, j - i));
+        i = j + 1;
+    }
+}
+
+/* Parse RFC822-style "Key: Value" data (with continuation lines marked by
+ * leading whitespace) into a sequence of dictionaries, one per blank-line
+ * delimited stanza.  Matches the parser in cumulus-restore. */
+static void parse_stanzas(const vector<string> &lines,
+                          vector<dictionary> *items)
+{
+    dictionary current;
+    string last_key;
+
+    for (size_t i = 0; i <= lines.size(); i++) {
+        const string line = (i < lines.size()) ? lines[i] : "";
+
+        if (line.empty()) {
+            if (!current.empty()) {
+                items->push_back(current);
+                current.clear();
+            }
+            last_key = "";
+            continue;
+        }
+
+        if (isspace(line[0])) {
+            if (!last_key.empty())
+                current[last_key] += line;
+            continue;
+        }
+
+        size_t colon = line.find(':');
+        if (colon == string::npos) {
+            last_key = "";
+            continue;
+        }
+        string key = line.substr(0, colon);
+        size_t start = colon + 1;
+        while (start < line.size() && isspace(line[start]))
+            start++;
+        current[key] = line.substr(start);
+        last_key = key;
+    }
+}
+
+/* Look up a field in a metadata dictionary, returning dflt if absent. */
+static string get_field(const dictionary &d, const string &key,
+                        const string &dflt = "")
+{
+    dictionary::const_iterator i = d.find(key);
+    return (i == d.end()) ? dflt : i->second;
+}
+
+/* Re-hash a file and compare against an expected checksum of the form
+ * "<algorithm>=<hex digits>".  Returns false (with *why set) on any
+ * failure. */
+static bool verify_file_checksum(const string &path, const string &expected,
+                                 string *why)
+{
+    size_t eq = expected.find('=');
+    if (eq == string::npos) {
+        *why = "malformed checksum: " + expected;
+        return false;
+    }
+
+    Hash *hash = Hash::New(expected.substr(0, eq));
+    if (hash == NULL) {
+        *why = "unknown checksum algorithm: " + expected.substr(0, eq);
+        return false;
+    }
+
+    if (!hash->update_from_file(path.c_str())) {
+        *why = "unable to read file";
+        delete hash;
+        return false;
+    }
+
+    string actual = hash->digest_str();
+    delete hash;
+    if (actual != expected) {
+        *why = "checksum mismatch (stored " + expected
+            + ", computed " + actual + ")";
+        return false;
+    }
+    return true;
+}
+
+/* Work list: one entry per segment stanza from the metadata file, handed out
+ * to the worker threads in order. */
+static vector<dictionary> work_list;
+static size_t work_next = 0;
+static int64_t bytes_verified = 0;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Verify a single segment against its recorded metadata. */
+static void verify_segment(const dictionary &info)
+{
+    string segment = get_field(info, "segment");
+    string path = get_field(info, "path");
+    string checksum = get_field(info, "checksum");
+
+    if (segment.empty() || path.empty()) {
+        report_error("Malformed segment metadata entry");
+        return;
+    }
+
+    string full_path = store_root + "/" + path;
+    struct stat stat_buf;
+    if (stat(full_path.c_str(), &stat_buf) < 0) {
+        report_error("Segment " + segment + ": missing file " + path);
+        return;
+    }
+
+    string disk_size = get_field(info, "disk_size");
+    if (!disk_size.empty()
+        && stat_buf.st_size != (off_t)parse_int(disk_size)) {
+        report_error(string_printf("Segment %s: size mismatch "
+                                   "(recorded %lld, found %lld)",
+                                   segment.c_str(),
+                                   (long long)parse_int(disk_size),
+                                   (long long)stat_buf.st_size));
+        return;
+    }
+
+    if (checksum.empty()) {
+        report_error("Segment " + segment + ": no checksum recorded");
+        return;
+    }
+
+    string why;
+    if (!verify_file_checksum(full_path, checksum, &why)) {
+        report_error("Segment " + segment + ": " + why);
+        return;
+    }
+
+    /* Optionally decompress the segment and walk its tar structure, checking
+     * that the objects add up to the recorded data size.  This catches
+     * errors made at backup time, which a checksum over the stored bytes
+     * cannot. */
+    if (check_objects) {
+        map<string, string> objects;
+        if (!segment_load(store_root, segment, &objects)) {
+            report_error("Segment " + segment + ": cannot load objects");
+            return;
+        }
+
+        int64_t data_bytes = 0;
+        for (map<string, string>::const_iterator i = objects.begin();
+             i != objects.end(); ++i)
+            data_bytes += i->second.size();
+
+        string data_size = get_field(info, "data_size");
+        if (!data_size.empty() && data_bytes != parse_int(data_size)) {
+            report_error(string_printf("Segment %s: object data mismatch "
+                                       "(recorded %lld bytes, found %lld in "
+                                       "%zd objects)",
+                                       segment.c_str(),
+                                       (long long)parse_int(data_size),
+                                       (long long)data_bytes,
+                                       objects.size()));
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&work_lock);
+    bytes_verified += stat_buf.st_size;
+    pthread_mutex_unlock(&work_lock);
+}
+
+static void *verify_worker(void *)
+{
+    for (;;) {
+        pthread_mutex_lock(&work_lock);
+        if (work_next >= work_list.size()) {
+            pthread_mutex_unlock(&work_lock);
+            return NULL;
+        }
+        size_t idx = work_next++;
+        pthread_mutex_unlock(&work_lock);
+
+        verify_segment(work_list[idx]);
+    }
+}
+
+/* Load and parse the snapshot descriptor with the given name.  The name may
+ * be given with or without the "snapshot-" prefix and filename extension;
+ * the normalized name (scheme and timestamp) is stored in *name_out. */
+static dictionary load_snapshot_descriptor(const string &name,
+                                           string *name_out)
+{
+    static const char *const snapshot_dirs[] = { "snapshots", "", NULL };
+
+    string basename = name;
+    if (basename.compare(0, 9, "snapshot-") != 0)
+        basename = "snapshot-" + basename;
+    size_t dot = basename.rfind('.');
+    if (dot != string::npos) {
+        string ext = basename.substr(dot);
+        if (ext == ".cumulus" || ext == ".lbs")
+            basename = basename.substr(0, dot);
+    }
+    *name_out = basename.substr(9);
+
+    string data;
+    if (!store_load_file(store_root, snapshot_dirs, basename + ".cumulus",
+                         &data)
+        && !store_load_file(store_root, snapshot_dirs, basename + ".lbs",
+                            &data))
+        fatal("Snapshot not found: " + name);
+
+    vector<string> lines;
+    split_lines(data, &lines);
+    vector<dictionary> stanzas;
+    parse_stanzas(lines, &stanzas);
+    if (stanzas.empty())
+        fatal("Empty snapshot descriptor: " + name);
+    return stanzas[0];
+}
+
+static void usage(const char *program)
+{
+    fprintf(
+        stderr,
+        "Cumulus %s\n\n"
+        "Usage: %s [OPTION]... STORE SNAPSHOT\n"
+        "Verify the segments of a snapshot in a local Cumulus storage\n"
+        "directory against the checksums recorded when it was written.\n"
+        "\n"
+        "Options:\n"
+        "  --threads=N          number of parallel verification threads\n"
+        "                       (default: 1)\n"
+        "  --check-objects      also decompress each segment and check its\n"
+        "                       object-level tar structure\n"
+        "  --decode-filter=EXT:COMMAND\n"
+        "                       decode segment files ending in EXT by piping\n"
+        "                       them through COMMAND (for stores written with\n"
+        "                       a non-default --filter)\n",
+        cumulus_version, program);
+}
+
+int main(int argc, char *argv[])
+{
+    hash_init();
+
+    for (;;) {
+        static struct option long_options[] = {
+            {"threads", 1, 0, 0},           // 0
+            {"check-objects", 0, 0, 0},     // 1
+            {"decode-filter", 1, 0, 0},     // 2
+            {NULL, 0, 0, 0},
+        };
+
+        int long_index;
+        int c = getopt_long(argc, argv, "", long_options, &long_index);
+
+        if (c == -1)
+            break;
+
+        if (c == 0) {
+            switch (long_index) {
+            case 0:     // --threads
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 1:     // --check-objects
+                check_objects = true;
+                break;
+            case 2:     // --decode-filter
+                if (!segment_parse_filter_option(optarg)) {
+                    fprintf(stderr, "Invalid decode filter (expected "
+                            "EXT:COMMAND): %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Unhandled long option!\n");
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    store_root = argv[optind];
+    while (store_root.size() > 1 && store_root[store_root.size() - 1] == '/')
+        store_root.erase(store_root.size() - 1);
+
+    string snapshot_name;
+    dictionary descriptor
+        = load_snapshot_descriptor(argv[optind + 1], &snapshot_name);
+    string format = get_field(descriptor, "Format");
+    if (format.compare(0, 7, "Cumulus") != 0
+        && format.compare(0, 3, "LBS") != 0)
+        fatal("Unrecognized snapshot format: " + format);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Verify the segment-metadata file itself against the checksum in the
+     * descriptor, when both can be found; the checksum covers the file as
+     * stored (compressed), so locate the raw file by trying the standard
+     * suffixes. */
+    string meta_basename = "snapshot-" + snapshot_name + ".meta";
+    string meta_checksum = get_field(descriptor, "Segment-metadata");
+    if (!meta_checksum.empty()) {
+        static const char *const suffixes[] = { "", ".bz2", ".gz", NULL };
+        bool found = false;
+        for (int i = 0; suffixes[i] != NULL && !found; i++) {
+            string path = store_root + "/meta/" + meta_basename + suffixes[i];
+            if (access(path.c_str(), R_OK) != 0)
+                continue;
+            found = true;
+            string why;
+            if (!verify_file_checksum(path, meta_checksum, &why))
+                report_error("Segment metadata: " + why);
+        }
+        if (!found)
+            fprintf(stderr,
+                    "Warning: segment-metadata checksum not verified "
+                    "(no file with a standard suffix)\n");
+    }
+
+    /* Load the per-segment metadata and build the work list. */
+    static const char *const meta_dirs[] = { "meta", "", NULL };
+    string meta_data;
+    if (!store_load_file(store_root, meta_dirs, meta_basename, &meta_data))
+        fatal("Segment metadata not found: " + meta_basename);
+
+    vector<string> lines;
+    split_lines(meta_data, &lines);
+    parse_stanzas(lines, &work_list);
+
+    /* Every segment listed in the descriptor must have a metadata entry, or
+     * part of the snapshot would go unverified. */
+    std::set<string> known;
+    for (size_t i = 0; i < work_list.size(); i++)
+        known.insert(get_field(work_list[i], "segment"));
+
+    vector<string> listed;
+    string segment_list = get_field(descriptor, "Segments");
+    size_t pos = 0;
+    while (pos < segment_list.size()) {
+        size_t end = segment_list.find_first_of(" \t\n", pos);
+        if (end == string::npos)
+            end = segment_list.size();
+        if (end > pos)
+            listed.push_back(segment_list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    for (size_t i = 0; i < listed.size(); i++) {
+        if (known.find(listed[i]) == known.end())
+            report_error("Segment " + listed[i]
+                         + ": listed in descriptor but has no metadata");
+    }
+
+    vector<pthread_t> threads(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, verify_worker, NULL) != 0)
+            fatal("Cannot create verification thread");
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double elapsed = (finish.tv_sec - start.tv_sec)
+        + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("Verified %zd segments, %lld bytes in %.1f seconds (%.1f MB/s)\n",
+           work_list.size(), (long long)bytes_verified, elapsed,
+           elapsed > 0 ? bytes_verified / elapsed / 1e6 : 0.0);
+    if (error_count > 0) {
+        fprintf(stderr, "Verification FAILED: %d error(s)\n", error_count);
+        return 1;
+    }
+    printf("Verification OK\n");
+    return 0;
+}